@@ -0,0 +1,274 @@
+/* ------------------------------------- 
+	<latency.c>
+	• run bin/relay.elf in simavr with a scripted I2C master and switch presses
+	• measure interrupt durations, wake up and end-to-end latencies in CPU cycles
+	• write results as JSON
+------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_io.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_twi.h>
+
+#define MCU_NAME        "atmega88"
+#define MCU_FREQUENCY   8000000
+
+#define SLAVE_ADDRESS   0x70 //default address in eeprom (DEVICE_CLASS<<3)
+
+// ATmega88 vector numbers
+#define PCINT2_VECTOR       5
+#define WDT_VECTOR          6
+#define TIMER2_COMPA_VECTOR 7
+#define TIMER1_COMPA_VECTOR 11
+#define TIMER0_OVF_VECTOR   16
+#define SPI_STC_VECTOR      17
+#define TWI_VECTOR          24
+
+#define MAX_SAMPLES 256
+
+typedef struct {
+    const char *name;
+    uint32_t count;
+    avr_cycle_count_t min, max, total;
+} Stats;
+
+static void stats_add(Stats *stats, avr_cycle_count_t value) {
+    if ( stats->count == 0 || value < stats->min ) {
+        stats->min = value;
+    }
+    if ( value > stats->max ) {
+        stats->max = value;
+    }
+    stats->total += value;
+    stats->count++;
+}
+
+static void stats_print(FILE *out, Stats *stats, bool last) {
+    fprintf(out, "    \"%s\": {\"count\": %u, \"min\": %llu, \"max\": %llu, \"avg\": %llu}%s\n",
+        stats->name, stats->count,
+        (unsigned long long)stats->min, (unsigned long long)stats->max,
+        (unsigned long long)(stats->count ? stats->total/stats->count : 0),
+        last ? "" : ",");
+}
+
+static avr_t *avr = NULL;
+
+/* ------------- interrupt durations ------------ */
+
+typedef struct {
+    uint8_t vector;
+    avr_cycle_count_t enteredAt;
+    Stats stats;
+} VectorProbe;
+
+static VectorProbe probes[] = {
+    { TWI_VECTOR, 0, { "TWI_vect" } },
+    { PCINT2_VECTOR, 0, { "PCINT2_vect" } },
+    { TIMER0_OVF_VECTOR, 0, { "TIMER0_OVF_vect" } },
+    { SPI_STC_VECTOR, 0, { "SPI_STC_vect" } },
+    { TIMER2_COMPA_VECTOR, 0, { "TIMER2_COMPA_vect" } },
+    { TIMER1_COMPA_VECTOR, 0, { "TIMER1_COMPA_vect" } },
+    { WDT_VECTOR, 0, { "WDT_vect" } },
+};
+
+#define PROBES_COUNT (sizeof(probes)/sizeof(probes[0]))
+
+static Stats wakeUp = { "wake_to_first_instruction" };
+static avr_cycle_count_t pendingWhileSleeping = 0;
+
+// vector starts running (value=1) or returns with reti (value=0)
+static void vector_running(struct avr_irq_t *irq, uint32_t value, void *param) {
+    VectorProbe *probe = (VectorProbe *)param;
+
+    if ( value ) {
+        probe->enteredAt = avr->cycle;
+
+        if ( pendingWhileSleeping != 0 ) {
+            stats_add(&wakeUp, avr->cycle - pendingWhileSleeping);
+            pendingWhileSleeping = 0;
+        }
+    } else if ( probe->enteredAt != 0 ) {
+        stats_add(&probe->stats, avr->cycle - probe->enteredAt);
+        probe->enteredAt = 0;
+    }
+}
+
+// interrupt got pending, remember when it happened if cpu is asleep
+static void vector_pending(struct avr_irq_t *irq, uint32_t value, void *param) {
+    if ( value && avr->state == cpu_Sleeping && pendingWhileSleeping == 0 ) {
+        pendingWhileSleeping = avr->cycle;
+    }
+}
+
+/* ------------- latch edge ------------ */
+
+static Stats commandToLatch = { "set_command_to_latch" };
+static Stats powerDownCommandToLatch = { "power_down_set_command_to_latch" };
+static Stats pressToLatch = { "switch_press_to_latch" };
+static Stats *latchStats = NULL;
+static avr_cycle_count_t latchStartedAt = 0;
+
+static void latch_changed(struct avr_irq_t *irq, uint32_t value, void *param) {
+    if ( value && latchStats != NULL ) { //rising edge on LATCH_PIN
+        stats_add(latchStats, avr->cycle - latchStartedAt);
+        latchStats = NULL;
+    }
+}
+
+/* ------------- scripted master ------------ */
+
+static avr_irq_t *twiInput = NULL;
+static avr_irq_t *switchPins[8];
+
+static void run_cycles(avr_cycle_count_t cycles) {
+    avr_cycle_count_t until = avr->cycle + cycles;
+
+    while ( avr->cycle < until ) {
+        int state = avr_run(avr);
+        if ( state == cpu_Done || state == cpu_Crashed ) {
+            fprintf(stderr, "simulation stopped, state %d\n", state);
+            exit(1);
+        }
+    }
+}
+
+// one byte on 100kHz bus takes 9 clocks
+#define BYTE_CYCLES (MCU_FREQUENCY/100000*9)
+
+static void twi_message(uint8_t condition, uint8_t address, uint8_t data) {
+    avr_raise_irq(twiInput, avr_twi_irq_msg(condition, address, data));
+    run_cycles(BYTE_CYCLES);
+}
+
+static void master_write(const uint8_t *bytes, int count) {
+    twi_message(TWI_COND_START | TWI_COND_ADDR, SLAVE_ADDRESS<<1, 0);
+    for ( int i=0; i<count; i++ ) {
+        twi_message(TWI_COND_WRITE, SLAVE_ADDRESS<<1, bytes[i]);
+    }
+    avr_raise_irq(twiInput, avr_twi_irq_msg(TWI_COND_STOP, SLAVE_ADDRESS<<1, 0));
+}
+
+static void master_read(int count) {
+    twi_message(TWI_COND_START | TWI_COND_ADDR, (SLAVE_ADDRESS<<1) | 1, 0);
+    for ( int i=0; i<count; i++ ) {
+        twi_message(TWI_COND_READ | (i+1 < count ? TWI_COND_ACK : 0), (SLAVE_ADDRESS<<1) | 1, 0);
+    }
+    avr_raise_irq(twiInput, avr_twi_irq_msg(TWI_COND_STOP, SLAVE_ADDRESS<<1, 0));
+}
+
+static void press_switch(int pin, avr_cycle_count_t holdCycles) {
+    avr_raise_irq(switchPins[pin], 0); //active low
+    run_cycles(holdCycles);
+    avr_raise_irq(switchPins[pin], 1);
+}
+
+/* ---------------------------------------- */
+
+int main(int argc, char *argv[]) {
+    if ( argc < 2 ) {
+        fprintf(stderr, "usage: %s relay.elf [results.json]\n", argv[0]);
+        return 1;
+    }
+
+    elf_firmware_t firmware = {{0}};
+    if ( elf_read_firmware(argv[1], &firmware) != 0 ) {
+        fprintf(stderr, "can't read %s\n", argv[1]);
+        return 1;
+    }
+
+    avr = avr_make_mcu_by_name(MCU_NAME);
+    if ( avr == NULL ) {
+        fprintf(stderr, "simavr has no %s\n", MCU_NAME);
+        return 1;
+    }
+
+    avr_init(avr);
+    avr->frequency = MCU_FREQUENCY;
+    avr_load_firmware(avr, &firmware);
+
+    for ( unsigned i=0; i<PROBES_COUNT; i++ ) {
+        avr_irq_t *irqs = avr_get_interrupt_irq(avr, probes[i].vector);
+        avr_irq_register_notify(irqs + AVR_INT_IRQ_RUNNING, vector_running, &probes[i]);
+        avr_irq_register_notify(irqs + AVR_INT_IRQ_PENDING, vector_pending, NULL);
+    }
+
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2), latch_changed, NULL);
+
+    twiInput = avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT);
+    for ( int i=0; i<8; i++ ) {
+        switchPins[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), i);
+        avr_raise_irq(switchPins[i], 1); //pull-ups
+    }
+
+    run_cycles(MCU_FREQUENCY/2); //power up sequence and eeprom restore
+
+    //set commands, toggling one relay each time
+    for ( int i=0; i<64; i++ ) {
+        uint8_t frame[] = { 's', ((i & 1) ? 0xF0 : 0x00) | ((i%8)+1) };
+        master_write(frame, 2);
+
+        latchStartedAt = avr->cycle; //STOP condition
+        latchStats = &commandToLatch;
+        run_cycles(MCU_FREQUENCY/50);
+    }
+
+    //set commands far apart, board is in power down and wakes up on address match
+    for ( int i=0; i<16; i++ ) {
+        run_cycles(MCU_FREQUENCY/2); //command led and timers are off by now
+
+        uint8_t frame[] = { 't', (i%8)+1 };
+        master_write(frame, 2);
+
+        latchStartedAt = avr->cycle;
+        latchStats = &powerDownCommandToLatch;
+    }
+    run_cycles(MCU_FREQUENCY/50);
+
+    //read commands
+    for ( int i=0; i<32; i++ ) {
+        uint8_t frame[] = { 'G', 0x00 };
+        master_write(frame, 2);
+        master_read(1);
+        run_cycles(MCU_FREQUENCY/1000);
+    }
+
+    //switch presses, toggle relays locally
+    for ( int i=0; i<32; i++ ) {
+        latchStartedAt = avr->cycle;
+        latchStats = &pressToLatch;
+        press_switch(i%8, MCU_FREQUENCY/10);
+        run_cycles(MCU_FREQUENCY/10);
+    }
+
+    //let the address timer run out
+    run_cycles(MCU_FREQUENCY*2);
+
+    FILE *out = stdout;
+    if ( argc > 2 && (out = fopen(argv[2], "w")) == NULL ) {
+        fprintf(stderr, "can't write %s\n", argv[2]);
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"mcu\": \"%s\",\n  \"frequency\": %d,\n  \"cycles\": {\n", MCU_NAME, MCU_FREQUENCY);
+    for ( unsigned i=0; i<PROBES_COUNT; i++ ) {
+        stats_print(out, &probes[i].stats, false);
+    }
+    stats_print(out, &wakeUp, false);
+    stats_print(out, &commandToLatch, false);
+    stats_print(out, &powerDownCommandToLatch, false);
+    stats_print(out, &pressToLatch, true);
+    fprintf(out, "  }\n}\n");
+
+    if ( out != stdout ) {
+        fclose(out);
+    }
+
+    return 0;
+}
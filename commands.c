@@ -0,0 +1,116 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <stdlib.h> 
+#include <stdbool.h> 
+
+#include "i2c.h"
+#include "output.h"
+#include "counters.h"
+#include "scenes.h"
+#include "rules.h"
+#include "timers.h"
+#include "commands.h"
+
+typedef struct {
+    uint8_t kind;
+    uint8_t argumentMask;
+    uint8_t argumentMin;
+    uint8_t argumentMax;
+} CommandInfo;
+
+typedef void (*WriteHandler)(uint8_t argument);
+typedef bool (*ReadHandler)(uint8_t argument, uint8_t index, volatile uint8_t *outputData);
+
+/* ------------- compile time checks ------------ */
+
+// every command byte has to be within the lookup range
+#define COMMAND_RANGE_CHECK(byte, name, kind, mask, min, max) \
+    typedef char command_##name##_is_out_of_range[((byte) >= COMMANDS_FIRST_BYTE && (byte) <= COMMANDS_LAST_BYTE) ? 1 : -1];
+COMMANDS_TABLE(COMMAND_RANGE_CHECK)
+
+// the same byte twice in the table is a duplicate case value
+#define COMMAND_CASE(byte, name, kind, mask, min, max) case (byte):
+static inline void commands_checkUnique(uint8_t command) {
+    switch ( command ) {
+        COMMANDS_TABLE(COMMAND_CASE)
+            break;
+    }
+}
+
+/* ------------- tables in flash ------------ */
+
+// command byte -> command id
+#define COMMAND_BYTE(byte, name, kind, mask, min, max) [(byte) - COMMANDS_FIRST_BYTE] = CommandId_##name,
+static const uint8_t commandIds[COMMANDS_LAST_BYTE - COMMANDS_FIRST_BYTE + 1] PROGMEM = {
+    COMMANDS_TABLE(COMMAND_BYTE)
+};
+
+// command id -> kind and argument check
+#define COMMAND_INFO(byte, name, kind, mask, min, max) [CommandId_##name] = { kind, mask, min, max },
+static const CommandInfo commandInfo[COMMAND_IDS_COUNT] PROGMEM = {
+    COMMANDS_TABLE(COMMAND_INFO)
+};
+
+// command id -> handler, only for its own kind
+#define WRITE_HANDLER_Command_Write(name) [CommandId_##name] = command_##name,
+#define WRITE_HANDLER_Command_Read(name)
+#define WRITE_HANDLER_Command_Register(name)
+#define WRITE_HANDLER(byte, name, kind, mask, min, max) WRITE_HANDLER_##kind(name)
+static const WriteHandler writeHandlers[COMMAND_IDS_COUNT] PROGMEM = {
+    COMMANDS_TABLE(WRITE_HANDLER)
+};
+
+#define READ_HANDLER_Command_Write(name)
+#define READ_HANDLER_Command_Read(name) [CommandId_##name] = command_##name,
+#define READ_HANDLER_Command_Register(name)
+#define READ_HANDLER(byte, name, kind, mask, min, max) READ_HANDLER_##kind(name)
+static const ReadHandler readHandlers[COMMAND_IDS_COUNT] PROGMEM = {
+    COMMANDS_TABLE(READ_HANDLER)
+};
+
+/* ---------------------------------------------- */
+
+// one flash read, no matter how many commands there are
+uint8_t commands_lookup(uint8_t command) {
+    if ( command < COMMANDS_FIRST_BYTE || command > COMMANDS_LAST_BYTE ) {
+        return CommandId_None;
+    }
+    return pgm_read_byte(&commandIds[command - COMMANDS_FIRST_BYTE]);
+}
+
+uint8_t commands_kind(uint8_t id) {
+    if ( id >= COMMAND_IDS_COUNT ) {
+        return Command_Invalid;
+    }
+    return pgm_read_byte(&commandInfo[id].kind); //CommandId_None is all zeros
+}
+
+bool commands_validArgument(uint8_t id, uint8_t argument) {
+    if ( id >= COMMAND_IDS_COUNT ) {
+        return false;
+    }
+
+    uint8_t value = argument & pgm_read_byte(&commandInfo[id].argumentMask);
+    return ( value >= pgm_read_byte(&commandInfo[id].argumentMin)
+          && value <= pgm_read_byte(&commandInfo[id].argumentMax) );
+}
+
+void commands_executeWrite(uint8_t id, uint8_t argument) {
+    if ( commands_kind(id) != Command_Write ) {
+        return;
+    }
+
+    WriteHandler handler = (WriteHandler)pgm_read_ptr(&writeHandlers[id]);
+    handler(argument);
+}
+
+bool commands_executeRead(uint8_t id, uint8_t argument, uint8_t index, volatile uint8_t *outputData) {
+    if ( commands_kind(id) != Command_Read ) {
+        *outputData = 0x00;
+        return false;
+    }
+
+    ReadHandler handler = (ReadHandler)pgm_read_ptr(&readHandlers[id]);
+    return handler(argument, index, outputData);
+}
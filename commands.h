@@ -0,0 +1,100 @@
+/* ------------------------------------- 
+	<commands.h>
+	• the whole i2c protocol in one table
+	• every command byte gets its kind, argument check and handler
+	• lookup tables are built at compile time and live in flash
+------------------------------------- */
+
+/* TABLE */
+// every command is a (command, argument) pair of bytes,
+// master can send several pairs in one transaction
+//
+// X(byte, name, kind, argument mask, min, max)
+// argument is valid when (argument & mask) is within [min, max], mask 0x00 accepts anything
+#define COMMANDS_TABLE(X) \
+    /* set commands */ \
+    X('s', SetPortValue,    Command_Write,    0x0F, 1, 8) /* lsb 4 bits — port 1-8 only, msb 4 bits — 0x1111 = on, 0x0000 = off; 'o'/'x' for higher ports */ \
+    X('S', SetAllPortBits,  Command_Write,    0x00, 0, 0) /* next byte of the mask, see 'B' */ \
+    X('B', SelectMaskByte,  Command_Write,    0xFF, 0, OUTPUT_BYTES-1) /* which mask byte the next 'S' replaces */ \
+    X('t', TogglePortValue, Command_Write,    0xFF, 1, OUTPUT_COUNT) \
+    X('o', SwitchPortOn,    Command_Write,    0xFF, 1, OUTPUT_COUNT) /* any port */ \
+    X('x', SwitchPortOff,   Command_Write,    0xFF, 1, OUTPUT_COUNT) \
+    X('f', AllSwitchOff,    Command_Write,    0x00, 0, 0) \
+    X('n', AllSwitchOn,     Command_Write,    0x00, 0, 0) \
+    /* two-phase switching, commit by a general call switches a whole group at once */ \
+    X('P', StageCommands,   Command_Write,    0xFF, 0, 1) /* 1 — next write commands are only staged */ \
+    X('C', CommitStaged,    Command_Write,    0xFF, 0, 1) /* 0 — apply staged mask, 1 — drop it */ \
+    /* timers, see timers.h */ \
+    X('D', SelectTimerLength, Command_Write,  0x00, 0, 0) /* length for the next 'p' and 'U', see TIMER_LENGTH() */ \
+    X('p', PulsePort,       Command_Write,    0xFF, 1, OUTPUT_COUNT) \
+    X('U', SetAutoOff,      Command_Write,    0xFF, 1, OUTPUT_COUNT) \
+    /* scenes, see scenes.h */ \
+    X('F', SceneSequenced,  Command_Write,    0xFF, 0, OUTPUT_COUNT) /* channel for the next 'W' to switch in sequence, 0 — none */ \
+    X('W', StoreScene,      Command_Write,    0xFF, 0, SCENES_COUNT-1) /* current or staged outputs to a slot */ \
+    X('Q', RecallScene,     Command_Write,    0xFF, 0, SCENES_COUNT-1) \
+    /* local rules, see rules.h: 'R' selects, 'M' and 'V' change, 'A' stores */ \
+    X('R', SelectRule,      Command_Write,    0xFF, 0, RULES_COUNT-1) /* RULE_INDEX(input, press type) */ \
+    X('M', RuleOutputsByte, Command_Write,    0x00, 0, 0) /* next byte of the outputs, lsb first */ \
+    X('V', RuleArgument,    Command_Write,    0x00, 0, 0) /* scene slot or pulse length */ \
+    X('A', RuleAction,      Command_Write,    0xFF, 0, RULE_ACTIONS_COUNT-1) \
+    /* group membership, see general call in i2c.h */ \
+    X('J', JoinGroup,       Command_Write,    0xFF, 1, I2C_GROUP_ALL-1) \
+    X('L', LeaveGroup,      Command_Write,    0xFF, 1, I2C_GROUP_ALL) /* I2C_GROUP_ALL leaves every group */ \
+    /* get commands, answered from TWI interrupt on the next SLA+R */ \
+    X('g', GetPortValue,    Command_Read,     0xFF, 0, OUTPUT_COUNT-1) /* return port by number */ \
+    X('G', GetAllPortBits,  Command_Read,     0xFF, 0, OUTPUT_BYTES-1) /* return mask bytes, starting from the argument */ \
+    X('e', GetEvents,       Command_Read,     0x00, 0, 0) /* drain switch events queue, see events_readByte() */ \
+    X('c', GetCounters,     Command_Read,     0xFF, 0, COUNTERS_COUNT-1) /* diagnostic counters, starting from the argument */ \
+    X('w', GetScenes,       Command_Read,     0xFF, 0, SCENES_COUNT-1) /* scene slots, starting from the argument */ \
+    X('a', GetRules,        Command_Read,     0xFF, 0, RULES_COUNT-1) /* rules, starting from the argument */ \
+    X('d', GetTimers,       Command_Read,     0xFF, 0, OUTPUT_COUNT-1) /* time left, starting from the argument */ \
+    X('j', GetGroups,       Command_Read,     0x00, 0, 0) /* all membership slots */ \
+    /* following reads return registers, starting from the argument */ \
+    X('r', SelectRegister,  Command_Register, 0xFF, 0, I2C_REGISTERS_COUNT-1)
+
+// all command bytes are within this range
+#define COMMANDS_FIRST_BYTE     'A'
+#define COMMANDS_LAST_BYTE      'z'
+
+enum CommandKinds {
+    Command_Invalid = 0x00, //not in the table
+    Command_Write, //queued, executed in the main loop
+    Command_Read, //answered right from the interrupt
+    Command_Register, //argument is a register pointer for the next reads
+};
+
+// command ids, zero is reserved for unknown commands
+#define COMMAND_ID(byte, name, kind, mask, min, max) CommandId_##name,
+enum CommandIds {
+    CommandId_None = 0x00,
+    COMMANDS_TABLE(COMMAND_ID)
+    COMMAND_IDS_COUNT
+};
+#undef COMMAND_ID
+
+/* HANDLERS */
+// implemented by main.c, one for each command in the table:
+// write commands — void command_<name>(uint8_t argument), called from the main loop
+// read commands — bool command_<name>(uint8_t argument, uint8_t index, volatile uint8_t *outputData),
+//   called from TWI interrupt for every byte master reads, index starts from zero on each SLA+R,
+//   return true if there are more bytes to send
+#define COMMAND_HANDLER_Command_Write(name) void command_##name(uint8_t argument);
+#define COMMAND_HANDLER_Command_Read(name) bool command_##name(uint8_t argument, uint8_t index, volatile uint8_t *outputData);
+#define COMMAND_HANDLER_Command_Register(name)
+#define COMMAND_HANDLER(byte, name, kind, mask, min, max) COMMAND_HANDLER_##kind(name)
+COMMANDS_TABLE(COMMAND_HANDLER)
+#undef COMMAND_HANDLER
+
+/* FUNCTIONS */
+// command id by its byte, CommandId_None for unknown commands
+uint8_t commands_lookup(uint8_t command);
+
+// kind of a command, see CommandKinds
+uint8_t commands_kind(uint8_t id);
+
+// check the argument against the table
+bool commands_validArgument(uint8_t id, uint8_t argument);
+
+// run handlers by command id
+void commands_executeWrite(uint8_t id, uint8_t argument);
+bool commands_executeRead(uint8_t id, uint8_t argument, uint8_t index, volatile uint8_t *outputData);
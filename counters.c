@@ -0,0 +1,28 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdlib.h> 
+#include <stdbool.h> 
+
+#include "counters.h"
+
+#define NOINIT_MAGIC 0xC0DE
+
+volatile uint16_t counters[COUNTERS_COUNT];
+
+// .noinit is not cleared on startup, so these values live through a watchdog reset
+static uint16_t noinitMagic __attribute__((section(".noinit")));
+static uint16_t noinitWatchdogResets __attribute__((section(".noinit")));
+
+void init_counters(uint8_t resetFlags) {
+    //ram is garbage after power on, brown out or the first start
+    if ( (resetFlags & (_BV(PORF)|_BV(BORF))) || noinitMagic != NOINIT_MAGIC ) {
+        noinitMagic = NOINIT_MAGIC;
+        noinitWatchdogResets = 0;
+    }
+
+    if ( resetFlags & _BV(WDRF) ) {
+        noinitWatchdogResets++;
+    }
+
+    counters[Counter_WatchdogResets] = noinitWatchdogResets;
+}
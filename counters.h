@@ -0,0 +1,48 @@
+/* ------------------------------------- 
+	<counters.h>
+	• runtime counters for diagnostics over i2c
+	• interrupt entries, bus errors, wake ups and main loop timing
+	• watchdog resets survive the reset itself
+------------------------------------- */
+
+/* COUNTERS */
+// all counters are 16 bit and wrap around, except the maximums
+enum CounterIds {
+    //interrupt entries
+    Counter_TWI = 0,
+    Counter_PCINT0,
+    Counter_PCINT1,
+    Counter_PCINT2,
+    Counter_TIMER0_OVF,
+    Counter_TIMER0_COMPB,
+    Counter_TIMER1_COMPA,
+    Counter_TIMER2_COMPA,
+    Counter_EE_READY,
+    Counter_WDT,
+    Counter_SPI_STC,
+
+    Counter_BusErrors, //unexpected TWI states
+    Counter_QueueFull, //frames refused because commands queue was full
+    Counter_InvalidCommands, //unknown command bytes and arguments out of range
+    Counter_MaxLoopTime, //the longest time from wake up to sleep, in timer1 counts (128us)
+    Counter_EepromWrites, //bytes written to eeprom
+    Counter_Wakes, //main loop woke up from sleep
+    Counter_WatchdogResets, //since the last power on
+    Counter_ChainOverflows, //address frames with a position past the end of the chain
+
+    COUNTERS_COUNT
+};
+
+extern volatile uint16_t counters[COUNTERS_COUNT];
+
+/* FUNCTIONS */
+// call once after reset with MCUSR value, before it is cleared
+void init_counters(uint8_t resetFlags);
+
+// count one more event, interrupts have to be disabled (e.g. inside ISR)
+#define counters_increment(id) (counters[(id)]++)
+
+// keep the largest value seen, interrupts have to be disabled
+#define counters_max(id, value) do { \
+        if ( (value) > counters[(id)] ) counters[(id)] = (value); \
+    } while (0)
@@ -0,0 +1,21 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdlib.h> 
+#include <stdbool.h> 
+
+#include "dispatch.h"
+
+// interrupts may post new tasks between read and clear
+uint8_t dispatch_take() {
+    uint8_t sreg = SREG;
+    cli();
+    uint8_t tasks = DISPATCH_FLAGS;
+    DISPATCH_FLAGS = 0x00;
+    SREG = sreg;
+
+    return tasks;
+}
+
+bool dispatch_pending(uint8_t tasks) {
+    return (DISPATCH_FLAGS & tasks) != 0x00;
+}
@@ -0,0 +1,31 @@
+/* ------------------------------------- 
+	<dispatch.h>
+	• pending work of all modules in one flag byte
+	• interrupts post tasks, main loop runs only what is pending
+	• board sleeps as soon as nothing is pending
+------------------------------------- */
+
+/* TASKS */
+// main loop runs pending tasks in this order
+enum DispatchTasks {
+    Task_I2C = (1<<0), //write commands in the queue
+    Task_Output = (1<<1), //new relays state for the shift register
+    Task_Interface = (1<<2), //test button was pressed
+    Task_Registers = (1<<3), //register block is out of date
+    Task_Housekeeping = (1<<4), //eeprom save or switches recalibration is due
+};
+
+// flags live in a general purpose I/O register, so posting one task
+// is a single sbi instruction and is safe from both interrupts and the main loop;
+// a mask of several tasks would be in/ori/out, so every task is posted on its own
+#define DISPATCH_FLAGS  GPIOR0
+
+/* FUNCTIONS */
+// mark one task as pending, exactly one bit of DispatchTasks
+#define dispatch_post(task) (DISPATCH_FLAGS |= (task))
+
+// take all pending tasks and clear them
+uint8_t dispatch_take();
+
+// is any of given tasks pending
+bool dispatch_pending(uint8_t tasks);
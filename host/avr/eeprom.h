@@ -0,0 +1,20 @@
+/* ------------------------------------- 
+	<avr/eeprom.h> (host build)
+	• EEMEM variables are ordinary memory
+	• every write is counted, see sim.h
+------------------------------------- */
+
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EEMEM
+
+uint8_t eeprom_read_byte(const uint8_t *address);
+void eeprom_write_byte(uint8_t *address, uint8_t value);
+void eeprom_read_block(void *destination, const void *source, size_t size);
+void eeprom_write_block(const void *source, void *destination, size_t size);
+
+#endif
@@ -0,0 +1,17 @@
+/* ------------------------------------- 
+	<avr/interrupt.h> (host build)
+	• interrupt vectors are plain functions, tests call them directly
+	• global interrupt flag lives in SREG
+------------------------------------- */
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) void vector(void)
+
+#define sei() (SREG |= 0x80)
+#define cli() (SREG &= ~0x80)
+
+#endif
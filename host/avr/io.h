@@ -0,0 +1,150 @@
+/* ------------------------------------- 
+	<avr/io.h> (host build)
+	• ATmega88 registers as plain variables
+	• only registers and bits used by the firmware
+------------------------------------- */
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+/* PORTS */
+extern volatile uint8_t PINB, DDRB, PORTB;
+extern volatile uint8_t PINC, DDRC, PORTC;
+extern volatile uint8_t PIND, DDRD, PORTD;
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+/* STATUS */
+extern volatile uint8_t SREG, MCUSR, SMCR, PRR;
+extern volatile uint8_t GPIOR0;
+
+#define WDRF 3
+#define BORF 2
+#define EXTRF 1
+#define PORF 0
+
+#define SE 0
+#define SM0 1
+#define SM1 2
+#define SM2 3
+
+/* WATCHDOG */
+extern volatile uint8_t WDTCSR;
+
+#define WDIF 7
+#define WDIE 6
+#define WDP3 5
+#define WDCE 4
+#define WDE 3
+#define WDP2 2
+#define WDP1 1
+#define WDP0 0
+
+/* PIN CHANGE INTERRUPTS */
+extern volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define PCIF2 2
+#define PCINT0 0
+#define PCINT11 3
+
+/* TWI */
+extern volatile uint8_t TWCR, TWSR, TWDR, TWAR, TWAMR, TWBR;
+
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+#define TWGCE 0
+
+/* SPI */
+extern volatile uint8_t SPCR, SPSR, SPDR;
+
+#define SPIE 7
+#define SPE 6
+#define DORD 5
+#define MSTR 4
+#define SPIF 7
+#define SPI2X 0
+
+/* TIMER 0 */
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0, TIFR0;
+
+#define WGM00 0
+#define WGM01 1
+#define WGM02 3
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+#define TOV0 0
+#define OCF0A 1
+#define OCF0B 2
+
+/* TIMER 1 */
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t TCNT1, OCR1A, OCR1B;
+
+#define WGM12 3
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define OCIE1A 1
+#define OCF1A 1
+
+/* TIMER 2 */
+extern volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, TIFR2, ASSR;
+
+#define WGM21 1
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define OCIE2A 1
+#define OCF2A 1
+
+/* EEPROM */
+extern volatile uint8_t EECR, EEDR;
+extern volatile uint16_t EEAR;
+
+#define EERIE 3
+#define EEMPE 2
+#define EEPE 1
+#define EERE 0
+
+#define E2END 0x1FF
+
+#endif
@@ -0,0 +1,17 @@
+/* ------------------------------------- 
+	<avr/pgmspace.h> (host build)
+	• flash and ram are the same memory
+------------------------------------- */
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_ptr(address) (*(void * const *)(address))
+
+#endif
@@ -0,0 +1,20 @@
+/* ------------------------------------- 
+	<avr/sleep.h> (host build)
+	• sleep returns right away
+	• sleep mode is kept in SMCR, so tests can check it
+------------------------------------- */
+
+#ifndef HOST_AVR_SLEEP_H
+#define HOST_AVR_SLEEP_H
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE 0x00
+#define SLEEP_MODE_PWR_DOWN (1<<SM1)
+
+#define set_sleep_mode(mode) (SMCR = (SMCR & ~((1<<SM0)|(1<<SM1)|(1<<SM2))) | (mode))
+#define sleep_enable() (SMCR |= (1<<SE))
+#define sleep_disable() (SMCR &= ~(1<<SE))
+#define sleep_cpu() ((void)0)
+
+#endif
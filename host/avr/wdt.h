@@ -0,0 +1,15 @@
+/* ------------------------------------- 
+	<avr/wdt.h> (host build)
+------------------------------------- */
+
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+
+#define WDTO_15MS 0
+#define WDTO_1S 6
+
+#define wdt_reset() ((void)0)
+#define wdt_enable(timeout) ((void)(timeout))
+#define wdt_disable() ((void)0)
+
+#endif
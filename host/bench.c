@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "sim.h"
+
+#include "output.h"
+#include "i2c.h"
+
+#define ITERATIONS  200000
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// one command per transaction, as masters did before burst mode
+void bench_singleCommands() {
+    uint8_t frame[] = { 't', 0x01 };
+
+    double start = now();
+    for ( long i=0; i<ITERATIONS; i++ ) {
+        sim_twiWrite(frame, 2);
+        process_i2c();
+        process_output();
+        sim_spi();
+    }
+    double elapsed = now() - start;
+
+    printf("single_commands_per_second %.0f\n", ITERATIONS/elapsed);
+}
+
+// as many commands per transaction as the queue takes
+void bench_burstCommands() {
+    uint8_t frames[64];
+    for ( int i=0; i<32; i++ ) {
+        frames[i*2] = 't';
+        frames[i*2+1] = (i%8)+1;
+    }
+
+    long commands = 0;
+    double start = now();
+    for ( long i=0; i<ITERATIONS; i++ ) {
+        commands += sim_twiWrite(frames, 64)/2;
+        process_i2c();
+        process_output();
+        sim_spi();
+    }
+    double elapsed = now() - start;
+
+    printf("burst_commands_per_second %.0f\n", commands/elapsed);
+    printf("burst_commands_per_transaction %.1f\n", (double)commands/ITERATIONS);
+}
+
+// read command answered from the interrupt
+void bench_reads() {
+    uint8_t frame[] = { 'G', 0x00 };
+    uint8_t result;
+
+    double start = now();
+    for ( long i=0; i<ITERATIONS; i++ ) {
+        sim_twiWrite(frame, 2);
+        sim_twiRead(&result, 1);
+    }
+    double elapsed = now() - start;
+
+    printf("reads_per_second %.0f\n", ITERATIONS/elapsed);
+}
+
+int main() {
+    sim_reset();
+
+    bench_singleCommands();
+    bench_burstCommands();
+    bench_reads();
+
+    return 0;
+}
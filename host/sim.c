@@ -0,0 +1,195 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/twi.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "sim.h"
+
+/* ------------- registers ------------ */
+
+volatile uint8_t PINB, DDRB, PORTB;
+volatile uint8_t PINC, DDRC, PORTC;
+volatile uint8_t PIND, DDRD, PORTD;
+
+volatile uint8_t SREG, MCUSR, SMCR, PRR;
+volatile uint8_t WDTCSR;
+volatile uint8_t GPIOR0;
+volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+volatile uint8_t TWCR, TWSR, TWDR, TWAR, TWAMR, TWBR;
+volatile uint8_t SPCR, SPSR, SPDR;
+
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0, TIFR0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t TCNT1, OCR1A, OCR1B;
+volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, TIFR2, ASSR;
+
+volatile uint8_t EECR, EEDR;
+volatile uint16_t EEAR;
+
+volatile uint32_t sim_delayedMicroseconds = 0;
+uint32_t sim_eepromWrites = 0;
+int sim_failures = 0;
+
+/* ------------- eeprom ------------ */
+
+// EEMEM variables live in RAM, eeprom functions just copy them
+uint8_t eeprom_read_byte(const uint8_t *address) {
+    return *address;
+}
+
+void eeprom_write_byte(uint8_t *address, uint8_t value) {
+    *address = value;
+    sim_eepromWrites++;
+}
+
+void eeprom_read_block(void *destination, const void *source, size_t size) {
+    memcpy(destination, source, size);
+}
+
+void eeprom_write_block(const void *source, void *destination, size_t size) {
+    memcpy(destination, source, size);
+    sim_eepromWrites += size;
+}
+
+/* ------------- firmware ------------ */
+
+void init_board();
+void init_i2c(uint8_t address);
+
+void sim_reset() {
+    SREG = 0x00;
+    PIND = 0xFF; //all switches released, pull-ups
+    PINB = 0xFF;
+    PINC = 0xFF;
+    sim_delayedMicroseconds = 0;
+    sim_eepromWrites = 0;
+
+    init_board(); //the same as after power up
+    init_i2c(0x70);
+
+    sim_ticks(SIM_POWER_UP_TICKS);
+}
+
+/* ------------- TWI ------------ */
+
+uint8_t sim_twi(uint8_t status, uint8_t data) {
+    TWSR = status;
+    TWDR = data;
+    TWCR |= (1<<TWINT); //other bits keep what firmware wrote last time
+
+    TWI_vect();
+
+    return TWCR;
+}
+
+uint8_t sim_twiWrite(const uint8_t *bytes, uint8_t count) {
+    uint8_t acknowledged = 0;
+
+    if ( (TWCR & (1<<TWEA)) == 0 ) {
+        return 0; //own address is not recognized, nobody answers
+    }
+
+    bool ack = (sim_twi(TW_SR_SLA_ACK, 0x00) & (1<<TWEA)) != 0;
+
+    for ( uint8_t i=0; i<count; i++ ) {
+        if ( !ack ) {
+            sim_twi(TW_SR_DATA_NACK, bytes[i]); //byte was not acknowledged, master gives up
+            return acknowledged;
+        }
+
+        ack = (sim_twi(TW_SR_DATA_ACK, bytes[i]) & (1<<TWEA)) != 0;
+        acknowledged++;
+    }
+
+    sim_twi(TW_SR_STOP, 0x00);
+    return acknowledged;
+}
+
+uint8_t sim_twiGeneralCall(const uint8_t *bytes, uint8_t count) {
+    uint8_t acknowledged = 0;
+
+    if ( (TWCR & (1<<TWEA)) == 0 || (TWAR & (1<<TWGCE)) == 0 ) {
+        return 0; //general call is not recognized
+    }
+
+    bool ack = (sim_twi(TW_SR_GCALL_ACK, 0x00) & (1<<TWEA)) != 0;
+
+    for ( uint8_t i=0; i<count; i++ ) {
+        if ( !ack ) {
+            sim_twi(TW_SR_GCALL_DATA_NACK, bytes[i]);
+            return acknowledged;
+        }
+
+        ack = (sim_twi(TW_SR_GCALL_DATA_ACK, bytes[i]) & (1<<TWEA)) != 0;
+        acknowledged++;
+    }
+
+    sim_twi(TW_SR_STOP, 0x00);
+    return acknowledged;
+}
+
+void sim_twiRead(uint8_t *bytes, uint8_t count) {
+    if ( (TWCR & (1<<TWEA)) == 0 ) {
+        memset(bytes, 0xFF, count); //own address is not recognized, master reads ones
+        return;
+    }
+
+    bool more = (sim_twi(TW_ST_SLA_ACK, 0x00) & (1<<TWEA)) != 0;
+    bool released = false;
+
+    for ( uint8_t i=0; i<count; i++ ) {
+        bytes[i] = released ? 0xFF : TWDR; //slave has released the bus, master reads ones
+
+        if ( released ) {
+            continue;
+        } else if ( i+1 == count ) {
+            sim_twi(TW_ST_DATA_NACK, 0x00); //master is done
+        } else if ( more ) {
+            more = (sim_twi(TW_ST_DATA_ACK, 0x00) & (1<<TWEA)) != 0;
+        } else {
+            sim_twi(TW_ST_LAST_DATA, 0x00); //master wanted more than slave had
+            released = true;
+        }
+    }
+}
+
+/* ------------- inputs and timers ------------ */
+
+void sim_setInputs(uint8_t levels) {
+    uint8_t changed = PIND ^ levels;
+    PIND = levels;
+
+    if ( changed & PCMSK2 ) {
+        PCIFR |= _BV(PCIE2);
+    }
+
+    if ( (PCICR & _BV(PCIE2)) && (PCIFR & _BV(PCIE2)) ) {
+        PCIFR &= ~_BV(PCIE2);
+        PCINT2_vect();
+    }
+}
+
+void sim_spi() {
+    while ( SPCR & _BV(SPIE) ) {
+        SPI_STC_vect(); //a byte takes 16 cycles at fosc/2, nothing else happens meanwhile
+    }
+}
+
+void sim_ticks(uint16_t count) {
+    for ( uint16_t i=0; i<count; i++ ) {
+        TIMER2_COMPA_vect();
+        sim_spi(); //whole chain is out long before the next tick
+
+        if ( EECR & _BV(EERIE) ) {
+            EE_READY_vect();
+        }
+
+        //pin change flag stays set while the interrupt is masked
+        if ( (PCICR & _BV(PCIE2)) && (PCIFR & _BV(PCIE2)) ) {
+            PCIFR &= ~_BV(PCIE2);
+            PCINT2_vect();
+        }
+    }
+}
@@ -0,0 +1,60 @@
+/* ------------------------------------- 
+	<sim.h>
+	• simulated AVR around the firmware modules
+	• drive TWI, pin change and timer interrupts from tests
+------------------------------------- */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* FIRMWARE INTERRUPTS */
+void TWI_vect(void);
+void PCINT0_vect(void);
+void PCINT1_vect(void);
+void PCINT2_vect(void);
+void TIMER0_OVF_vect(void);
+void TIMER0_COMPB_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER2_COMPA_vect(void);
+void EE_READY_vect(void);
+void WDT_vect(void);
+void SPI_STC_vect(void);
+
+#define SIM_POWER_UP_TICKS  20 //power lines are on and switches are listened to
+
+/* FUNCTIONS */
+void sim_reset(); //clear registers, init all firmware modules and wait for power up
+
+// run one TWI interrupt with given status and data, returns TWCR written by the firmware
+uint8_t sim_twi(uint8_t status, uint8_t data);
+
+// master writes bytes to us, returns number of bytes we acknowledged
+uint8_t sim_twiWrite(const uint8_t *bytes, uint8_t count);
+
+// master sends a general call, returns number of bytes we acknowledged
+uint8_t sim_twiGeneralCall(const uint8_t *bytes, uint8_t count);
+
+// master reads bytes from us, acknowledges all but the last one
+void sim_twiRead(uint8_t *bytes, uint8_t count);
+
+// change levels on the switch lines, pin change interrupt fires if enabled
+void sim_setInputs(uint8_t levels);
+
+// let the system tick run, eeprom finishes one byte per tick
+void sim_ticks(uint16_t count);
+
+// SPI shifts out everything started so far, interrupt fires after every byte
+void sim_spi();
+
+// number of bytes written to eeprom since reset
+extern uint32_t sim_eepromWrites;
+
+// test helpers
+extern int sim_failures;
+
+#define CHECK(condition) do { \
+        if ( !(condition) ) { \
+            sim_failures++; \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        } \
+    } while (0)
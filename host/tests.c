@@ -0,0 +1,1054 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+
+#include "input.h"
+#include "output.h"
+#include "i2c.h"
+#include "storage.h"
+#include "interface.h"
+#include "dispatch.h"
+#include "counters.h"
+#include "scenes.h"
+#include "rules.h"
+#include "timers.h"
+#include <util/delay.h>
+#include <util/twi.h>
+
+void update_registers();
+
+/* ------------- i2c protocol ------------ */
+
+void test_singleCommand() {
+    uint8_t frame[] = { 'S', 0xA5 };
+    CHECK(sim_twiWrite(frame, 2) == 2);
+
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0xA5);
+}
+
+void test_burstWrite() {
+    uint8_t frames[] = { 'n', 0x00, 's', 0x02, 't', 0x03, 's', 0xF2 };
+    CHECK(sim_twiWrite(frames, 8) == 8);
+
+    process_i2c();
+    CHECK(currentOutputStateMask() == (OUTPUT_ALL & ~OUTPUT_BIT(2))); //all on, 2nd off, 3rd toggled off, 2nd on again
+}
+
+void test_burstStopsAtZeroCommand() {
+    uint8_t frames[] = { 'S', 0x0F, 0x00, 'S', 0xFF };
+    CHECK(sim_twiWrite(frames, 5) == 3); //zero byte is received, but not acknowledged
+
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x0F);
+}
+
+void test_commandsAreValidated() {
+    uint8_t unknown[] = { 'Z', 0x01, 'S', 0xFF };
+    CHECK(sim_twiWrite(unknown, 4) == 1); //unknown command ends the burst
+    CHECK(counters[Counter_InvalidCommands] == 1);
+
+    uint8_t frames[] = { 't', OUTPUT_COUNT+1, 's', 0xF0, 'S', 0x3C, 't', 0x01 };
+    CHECK(sim_twiWrite(frames, 8) == 8); //bad arguments are dropped, the rest is received
+    CHECK(counters[Counter_InvalidCommands] == 3);
+    CHECK(i2c_queueDepth() == 2);
+
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x3D);
+
+    uint8_t select[] = { 'r', I2C_REGISTERS_COUNT };
+    sim_twiWrite(select, 2);
+    CHECK(counters[Counter_InvalidCommands] == 4);
+
+    uint8_t read[] = { 'G', 0x00 };
+    sim_twiWrite(read, 2);
+    uint8_t mask;
+    sim_twiRead(&mask, 1);
+    CHECK(mask == 0x3D);
+}
+
+void test_chainedRegisters() {
+    uint8_t frames[] = { 'o', OUTPUT_COUNT, 'o', 0x01, 'x', 0x01 };
+    sim_twiWrite(frames, 6);
+
+    process_i2c();
+    process_output();
+    sim_spi();
+    CHECK(currentOutputStateMask() == OUTPUT_BIT(OUTPUT_COUNT-1));
+    CHECK(SPDR == OUTPUT_BYTE(OUTPUT_BIT(OUTPUT_COUNT-1), 0)); //nearest register is shifted last
+
+#if OUTPUT_BYTES > 1
+    uint8_t bytes[] = { 'B', 0x00, 'S', 0x5A, 'S', 0xA5 };
+    sim_twiWrite(bytes, 6);
+
+    process_i2c();
+    process_output();
+    sim_spi();
+    CHECK(OUTPUT_BYTE(currentOutputStateMask(), 0) == 0x5A);
+    CHECK(OUTPUT_BYTE(currentOutputStateMask(), 1) == 0xA5);
+    CHECK(SPDR == 0x5A);
+
+    uint8_t read[] = { 'G', 0x00 };
+    sim_twiWrite(read, 2);
+    uint8_t mask[OUTPUT_BYTES];
+    sim_twiRead(mask, OUTPUT_BYTES);
+    CHECK(mask[0] == 0x5A && mask[1] == 0xA5);
+
+    //the byte pointer does not outlive its transaction, even while both wait in the queue
+    uint8_t second[] = { 'B', 0x01, 'S', 0x11 };
+    uint8_t first[] = { 'S', 0x22 };
+    sim_twiWrite(second, 4);
+    sim_twiWrite(first, 2);
+
+    process_i2c();
+    CHECK(OUTPUT_BYTE(currentOutputStateMask(), 0) == 0x22);
+    CHECK(OUTPUT_BYTE(currentOutputStateMask(), 1) == 0x11);
+#endif
+}
+
+void test_fullQueueIsNacked() {
+    uint8_t frames[(I2C_COMMANDS_QUEUE_SIZE+2)*2];
+    for ( int i=0; i<I2C_COMMANDS_QUEUE_SIZE+2; i++ ) {
+        frames[i*2] = 't';
+        frames[i*2+1] = 0x01;
+    }
+
+    uint8_t acknowledged = sim_twiWrite(frames, sizeof(frames));
+    CHECK(acknowledged == I2C_COMMANDS_QUEUE_SIZE*2); //every slot is used
+    CHECK(i2c_queueDepth() == I2C_COMMANDS_QUEUE_SIZE);
+    CHECK(i2c_rejectedFrames() == 1);
+
+    frames[0] = 'n';
+    CHECK(sim_twiWrite(frames, 2) == 0); //nothing fits until main loop runs
+    CHECK(i2c_rejectedFrames() == 2);
+
+    process_i2c();
+    CHECK(i2c_queueDepth() == 0);
+    CHECK(sim_twiWrite(frames, 2) == 2); //slave still answers to its address
+    CHECK(i2c_queueHighWater() == I2C_COMMANDS_QUEUE_SIZE);
+}
+
+extern uint8_t i2c_group_ids[I2C_GROUPS_COUNT];
+void housekeeping();
+void run_pending_tasks();
+void eeprom_restore_groups();
+
+void test_generalCallForGroups() {
+    uint8_t allOn[] = { 0x03, 'n', 0x00, 't', 0x01 };
+    CHECK(sim_twiGeneralCall(allOn, 5) == 1); //not a member, the rest is ignored
+    CHECK(i2c_queueDepth() == 0);
+
+    uint8_t join[] = { 'J', 0x03, 'J', 0x07 };
+    sim_twiWrite(join, 4);
+    process_i2c();
+
+    uint8_t select[] = { 'j', 0x00 };
+    sim_twiWrite(select, 2);
+    uint8_t slots[I2C_GROUPS_COUNT];
+    sim_twiRead(slots, I2C_GROUPS_COUNT);
+    CHECK(slots[0] == 0x03 && slots[1] == 0x07 && slots[2] == I2C_GROUP_NONE);
+
+    CHECK(sim_twiGeneralCall(allOn, 5) == 5);
+    process_i2c();
+    CHECK(currentOutputStateMask() == (OUTPUT_ALL & ~OUTPUT_BIT(0)));
+
+    uint8_t read[] = { I2C_GROUP_ALL, 'G', 0x00, 'f', 0x00 };
+    CHECK(sim_twiGeneralCall(read, 5) == 5); //everyone is in the last group
+    CHECK(counters[Counter_InvalidCommands] == 1); //but nobody answers reads
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x00);
+
+    housekeeping();
+    CHECK(i2c_group_ids[0] == 0x03 && i2c_group_ids[1] == 0x07);
+
+    uint8_t leave[] = { 'L', I2C_GROUP_ALL };
+    sim_twiWrite(leave, 2);
+    process_i2c();
+    CHECK(i2c_group(0) == I2C_GROUP_NONE && i2c_group(1) == I2C_GROUP_NONE);
+
+    eeprom_restore_groups(); //as after reset, before housekeeping has saved anything
+    CHECK(i2c_group(0) == 0x03 && i2c_group(1) == 0x07);
+}
+
+void test_stagedOutputsCommitTogether() {
+    uint8_t stage[] = { 'P', 0x01, 'o', 0x01, 'o', 0x02, 't', 0x02 };
+    sim_twiWrite(stage, 8);
+    run_pending_tasks();
+    sim_spi();
+    CHECK(currentOutputStateMask() == 0x00); //registers are not touched
+
+    uint8_t direct[] = { 'P', 0x00, 'o', 0x08 };
+    sim_twiWrite(direct, 4);
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x80); //staged mask waits meanwhile
+
+    uint8_t commit[] = { I2C_GROUP_ALL, 'C', 0x00 };
+    CHECK(sim_twiGeneralCall(commit, 3) == 3);
+    run_pending_tasks();
+    CHECK(currentOutputStateMask() == 0x01);
+    CHECK(output_busy()); //shift is started in the same pass
+
+    uint8_t drop[] = { 'P', 0x01, 'n', 0x00, 'C', 0x01, 'C', 0x00 };
+    sim_twiWrite(drop, 8);
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x01); //dropped, second commit has nothing to apply
+
+    uint8_t again[] = { 'o', 0x03 };
+    sim_twiWrite(again, 2);
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x05); //staging is over after a commit
+}
+
+void test_scenesFromCache() {
+    uint8_t recall[] = { 'Q', 0x00 };
+    sim_twiWrite(recall, 2);
+    process_i2c();
+    CHECK(counters[Counter_InvalidCommands] == 1); //slot is empty
+
+    uint8_t store[] = { 'o', 0x01, 'o', 0x02, 'F', 0x02, 'W', 0x00, 'f', 0x00 };
+    sim_twiWrite(store, 10);
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x00);
+
+    sim_twiWrite(recall, 2); //before anything is in eeprom
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x01); //the rest follows in sequence
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS*2);
+    CHECK(currentOutputStateMask() == 0x03 && !output_sequenceActive());
+
+    uint8_t list[] = { 'w', 0x00 };
+    sim_twiWrite(list, 2);
+    uint8_t answer[SCENE_RECORD_SIZE*2];
+    sim_twiRead(answer, sizeof(answer));
+    CHECK(answer[0] == 0x01 && answer[1] == 0x03 && answer[1+OUTPUT_BYTES] == 0x02);
+    CHECK(answer[SCENE_RECORD_SIZE] == 0x00); //second slot is empty
+
+    uint32_t writes = sim_eepromWrites;
+    housekeeping();
+    CHECK(sim_eepromWrites > writes && sim_eepromWrites - writes <= SCENE_RECORD_SIZE); //zero bytes match already
+    CHECK(!scenes_needSaving());
+
+    uint8_t again[] = { 'F', 0x02, 'W', 0x00 };
+    sim_twiWrite(again, 4);
+    process_i2c();
+    writes = sim_eepromWrites;
+    housekeeping();
+    CHECK(sim_eepromWrites == writes); //the same scene, nothing to write
+
+    init_scenes(); //as after reset
+    OutputMask mask, sequenced;
+    CHECK(scenes_get(0, &mask, &sequenced) && mask == 0x03 && sequenced == 0x02);
+    CHECK(!scenes_get(1, &mask, &sequenced));
+}
+
+void test_queueStatsRegisters() {
+    uint8_t frames[] = { 't', 0x01, 't', 0x02, 't', 0x03 };
+    sim_twiWrite(frames, 6);
+    process_i2c();
+    update_registers();
+
+    uint8_t select[] = { 'r', 0x06 };
+    sim_twiWrite(select, 2);
+
+    uint8_t registers[3];
+    sim_twiRead(registers, 3);
+    CHECK(registers[0] == I2C_COMMANDS_QUEUE_SIZE);
+    CHECK(registers[1] == 3); //high-water mark
+    CHECK(registers[2] == 0); //nothing rejected
+}
+
+void test_readCommandFromInterrupt() {
+    uint8_t frame[] = { 'S', 0x3C };
+    sim_twiWrite(frame, 2);
+    process_i2c();
+
+    uint8_t read[] = { 'G', 0x00 };
+    sim_twiWrite(read, 2);
+
+    uint8_t result = 0x00;
+    sim_twiRead(&result, 1); //no main loop in between
+    CHECK(result == 0x3C);
+
+    uint8_t port[] = { 'g', 0x02 };
+    sim_twiWrite(port, 2);
+    sim_twiRead(&result, 1);
+    CHECK(result == 0xFF);
+}
+
+void test_registerBlock() {
+    uint8_t frames[] = { 'S', 0x81, 'f', 0x00, 'B', 0x00, 'S', 0x81 };
+    sim_twiWrite(frames, 8);
+    process_i2c();
+    update_registers();
+
+    uint8_t select[] = { 'r', 0x00 };
+    sim_twiWrite(select, 2);
+
+    uint8_t registers[5];
+    sim_twiRead(registers, 5);
+    CHECK(registers[0] == 0x81); //output mask
+    CHECK(registers[1] == 0xFF); //no switches pressed
+    CHECK(registers[3] == 3 && registers[4] == 0); //pointer selection is not counted
+
+    uint8_t selectCounter[] = { 'r', 0x03 };
+    sim_twiWrite(selectCounter, 2);
+    sim_twiRead(registers, 2);
+    CHECK(registers[0] == 3);
+}
+
+/* ------------- counters ------------ */
+
+void test_countersOverI2C() {
+    uint8_t frame[] = { 't', 0x01 };
+    sim_twiWrite(frame, 2);
+    sim_twi(TW_BUS_ERROR, 0x00);
+
+    uint8_t select[] = { 'c', Counter_BusErrors };
+    sim_twiWrite(select, 2);
+
+    uint8_t errors[4];
+    sim_twiRead(errors, 4);
+    CHECK(errors[0] == 1 && errors[1] == 0); //bus errors
+    CHECK(errors[2] == 0 && errors[3] == 0); //nothing refused
+
+    uint8_t selectAll[] = { 'c', 0x00 };
+    sim_twiWrite(selectAll, 2);
+
+    uint8_t block[COUNTERS_COUNT*2 + 1];
+    sim_twiRead(block, sizeof(block));
+    CHECK(block[Counter_TWI*2] > 5); //every byte of the transactions above
+    CHECK(block[Counter_TIMER2_COMPA*2] == SIM_POWER_UP_TICKS);
+    CHECK(block[Counter_TIMER2_COMPA*2 + 1] == 0);
+    CHECK(block[COUNTERS_COUNT*2] == 0xFF); //slave has nothing more to send
+}
+
+void test_watchdogResetsAreKept() {
+    init_counters(_BV(PORF));
+    CHECK(counters[Counter_WatchdogResets] == 0);
+
+    init_counters(_BV(WDRF));
+    init_counters(_BV(WDRF));
+    CHECK(counters[Counter_WatchdogResets] == 2);
+
+    init_counters(_BV(EXTRF)); //reset button keeps the count
+    CHECK(counters[Counter_WatchdogResets] == 2);
+
+    init_counters(_BV(BORF));
+    CHECK(counters[Counter_WatchdogResets] == 0);
+}
+
+/* ------------- inputs ------------ */
+
+void test_debouncedToggle() {
+    sim_setInputs(0xFF & ~_BV(4));
+    sim_ticks(2);
+    sim_setInputs(0xFF); //contact bounce
+    sim_ticks(1);
+    sim_setInputs(0xFF & ~_BV(4));
+    CHECK(currentOutputStateMask() == 0x00);
+
+    sim_ticks(4);
+    CHECK(currentOutputStateMask() == _BV(4)); //toggled exactly once
+
+    sim_ticks(100); //keep holding
+    sim_setInputs(0xFF);
+    sim_ticks(10);
+    CHECK(currentOutputStateMask() == _BV(4));
+}
+
+void test_simultaneousPresses() {
+    sim_setInputs(0xFF & ~(_BV(1) | _BV(6)));
+    sim_ticks(5);
+    CHECK(currentOutputStateMask() == (_BV(1) | _BV(6)));
+}
+
+// drain all events with one read
+uint8_t readEvents(InputEvent *events, uint8_t maxEvents, bool *overflow) {
+    uint8_t command[] = { 'e', 0x00 };
+    sim_twiWrite(command, 2);
+
+    uint8_t bytes[1+3*16];
+    sim_twiRead(bytes, 1+3*maxEvents);
+
+    uint8_t count = bytes[0] & 0x7F;
+    *overflow = (bytes[0] & 0x80) != 0;
+
+    for ( uint8_t i=0; i<count && i<maxEvents; i++ ) {
+        events[i].info = bytes[1+i*3];
+        events[i].time = bytes[2+i*3] | (bytes[3+i*3]<<8);
+    }
+
+    return count;
+}
+
+void test_pressClassification() {
+    InputEvent events[16];
+    bool overflow;
+
+    //short press
+    sim_setInputs(0xFF & ~_BV(0));
+    sim_ticks(10);
+    sim_setInputs(0xFF);
+    sim_ticks(20);
+
+    uint8_t count = readEvents(events, 16, &overflow);
+    CHECK(count == 2 && !overflow); //a second press could still make it a double one
+    CHECK(events[0].info == (0 | INPUT_EVENT_PRESSED | (Press_Edge<<4)));
+    CHECK(events[1].info == (0 | (Press_Edge<<4)));
+    CHECK(events[1].time - events[0].time == 10);
+
+    sim_ticks(30);
+    count = readEvents(events, 16, &overflow);
+    CHECK(count == 1 && INPUT_EVENT_TYPE(events[0].info) == Press_Short);
+
+    //long press
+    sim_setInputs(0xFF & ~_BV(5));
+    sim_ticks(100);
+    sim_setInputs(0xFF);
+    sim_ticks(50);
+
+    count = readEvents(events, 16, &overflow);
+    CHECK(count == 3);
+    CHECK(INPUT_EVENT_PIN(events[1].info) == 5 && INPUT_EVENT_TYPE(events[1].info) == Press_Long);
+
+    //double press
+    for ( int i=0; i<2; i++ ) {
+        sim_setInputs(0xFF & ~_BV(3));
+        sim_ticks(8);
+        sim_setInputs(0xFF);
+        sim_ticks(8);
+    }
+
+    sim_ticks(50);
+    count = readEvents(events, 16, &overflow);
+    CHECK(count == 5); //no short press before the double one
+    CHECK(INPUT_EVENT_TYPE(events[3].info) == Press_Double);
+    CHECK((currentOutputStateMask() & _BV(3)) == 0); //every press edge toggles
+}
+
+void test_eventsOverflow() {
+    InputEvent events[16];
+    bool overflow;
+
+    for ( int i=0; i<12; i++ ) {
+        sim_setInputs(0xFF & ~_BV(7));
+        sim_ticks(5);
+        sim_setInputs(0xFF);
+        sim_ticks(5);
+    }
+
+    uint8_t count = readEvents(events, 4, &overflow);
+    CHECK(count == INPUT_EVENTS_QUEUE_SIZE && overflow);
+
+    count = readEvents(events, 16, &overflow);
+    CHECK(count == INPUT_EVENTS_QUEUE_SIZE-4 && !overflow); //only sent events left the queue
+}
+
+/* ------------- outputs ------------ */
+
+void test_localRules() {
+    uint8_t frames[] = {
+        'R', RULE_INDEX(0, Press_Edge), 'A', Rule_None, //leave the edge alone
+        'R', RULE_INDEX(0, Press_Short), 'M', 0x30, 'A', Rule_Toggle,
+        'R', RULE_INDEX(2, Press_Edge), 'M', 0x01, 'V', 0x02, 'A', Rule_Pulse,
+    };
+    sim_twiWrite(frames, sizeof(frames));
+    process_i2c();
+
+    sim_setInputs(0xFF & ~_BV(0));
+    sim_ticks(10);
+    CHECK(currentOutputStateMask() == 0x00); //edge does nothing now
+    sim_setInputs(0xFF);
+    sim_ticks(50);
+    CHECK(currentOutputStateMask() == 0x30); //short press toggles both
+
+    sim_setInputs(0xFF & ~_BV(2));
+    sim_ticks(5);
+    sim_setInputs(0xFF);
+    CHECK(currentOutputStateMask() == 0x31);
+    sim_ticks(20);
+    CHECK(currentOutputStateMask() == 0x30); //pulse is over after 200ms
+
+    sim_setInputs(0xFF & ~_BV(1));
+    sim_ticks(5);
+    sim_setInputs(0xFF);
+    CHECK(currentOutputStateMask() == 0x32); //untouched inputs keep the default
+
+    uint8_t endless[] = { 'R', RULE_INDEX(3, Press_Edge), 'M', 0x08, 'V', 0x00, 'A', Rule_Pulse };
+    sim_twiWrite(endless, sizeof(endless));
+    process_i2c();
+    sim_setInputs(0xFF & ~_BV(3));
+    sim_ticks(5);
+    sim_setInputs(0xFF);
+    sim_ticks(5);
+    CHECK(currentOutputStateMask() == 0x32); //a pulse without length is not applied
+
+    uint8_t select[] = { 'a', RULE_INDEX(0, Press_Short) };
+    sim_twiWrite(select, 2);
+    uint8_t rule[RULE_RECORD_SIZE];
+    sim_twiRead(rule, RULE_RECORD_SIZE);
+    CHECK(rule[0] == Rule_Toggle && rule[2] == 0x30);
+
+    housekeeping();
+    CHECK(!rules_needSaving());
+    init_rules(); //as after reset
+
+    Rule pulse;
+    rules_get(RULE_INDEX(2, Press_Edge), &pulse);
+    CHECK(pulse.action == Rule_Pulse && pulse.argument == 0x02 && pulse.outputs == 0x01);
+}
+
+void test_timersSwitchOutputsOff() {
+    uint8_t pulse[] = { 'D', TIMER_LENGTH(Timer_Tenths, 5), 'p', 0x03 };
+    sim_twiWrite(pulse, 4);
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x04);
+
+    uint8_t read[] = { 'd', 0x02 };
+    sim_twiWrite(read, 2);
+    uint8_t left[2];
+    sim_twiRead(left, 2);
+    CHECK(left[0] == 5 && left[1] == 0);
+
+    sim_ticks(60);
+    CHECK(currentOutputStateMask() == 0x00 && !timers_active());
+
+    uint8_t endless[] = { 'D', TIMER_LENGTH(Timer_Seconds, 0), 'p', 0x03 };
+    sim_twiWrite(endless, 4);
+    process_i2c();
+    CHECK(currentOutputStateMask() == 0x00); //zero length is refused
+    CHECK(counters[Counter_InvalidCommands] == 1);
+
+    uint8_t autoOff[] = { 'D', TIMER_LENGTH(Timer_Seconds, 1), 'U', 0x01, 'o', 0x01, 'o', 0x02 };
+    sim_twiWrite(autoOff, 8);
+    process_i2c();
+    CHECK(timers_active()); //system tick has to keep running
+    sim_ticks(90);
+    CHECK(currentOutputStateMask() == 0x03);
+    sim_ticks(30);
+    CHECK(currentOutputStateMask() == 0x02); //only the channel with auto-off
+
+    uint8_t manual[] = { 'o', 0x01, 'x', 0x01 };
+    sim_twiWrite(manual, 4);
+    process_i2c();
+    sim_ticks(10);
+    CHECK(timers_remaining(0) == 0 && !timers_active()); //switched off before it was over
+
+    setOutputStateMaskSlowly(0xF2);
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS);
+    clearOutputStateBits(0x02);
+    CHECK(output_sequenceActive()); //timer does not stop a running sequence
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS*5);
+    CHECK(currentOutputStateMask() == 0xF0);
+
+    housekeeping();
+    CHECK(!timers_needSaving());
+    init_timers(); //as after reset
+    CHECK(timers_autoOff(0) == TIMER_LENGTH(Timer_Seconds, 1) && timers_autoOff(1) == 0x00);
+}
+
+void test_sequenceDoesNotBlock() {
+    setOutputStateMaskSlowly(0xFF);
+    CHECK(currentOutputStateMask() == 0x00); //returns right away
+
+    sim_ticks(1);
+    CHECK(currentOutputStateMask() == 0x01);
+
+    uint8_t read[] = { 'G', 0x00 };
+    uint8_t result = 0x00;
+    CHECK(sim_twiWrite(read, 2) == 2); //bus works in the middle of a sequence
+    sim_twiRead(&result, 1);
+    CHECK(result == 0x01);
+
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS);
+    CHECK(currentOutputStateMask() == 0x03);
+
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS*8);
+    CHECK(currentOutputStateMask() == 0xFF && !output_sequenceActive());
+}
+
+void test_sequenceIsSuperseded() {
+    setOutputStateMaskSlowly(0xFF);
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS*2);
+
+    setOutputStateMaskSlowly(0x00); //running sequence turns back
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS*3);
+    CHECK(currentOutputStateMask() == 0x00);
+
+    setOutputStateMaskSlowly(0xFF);
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS*2);
+
+    uint8_t frame[] = { 'S', 0x81 }; //remote command cancels the sequence
+    sim_twiWrite(frame, 2);
+    process_i2c();
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS*8);
+    CHECK(currentOutputStateMask() == 0x81);
+}
+
+void test_outputShiftedFromInterrupt() {
+    sim_spi();
+    uint16_t bytes = counters[Counter_SPI_STC];
+
+    setOutputStateMask(0x12);
+    process_output();
+    CHECK(output_busy()); //returns with the first byte on the wire
+    CHECK(SPDR == OUTPUT_BYTE((OutputMask)0x12, OUTPUT_BYTES-1));
+
+    setOutputStateMask(0x34); //published during the shift, the shadow copy is not touched
+    process_output();
+
+    sim_spi();
+    CHECK(!output_busy());
+    CHECK(SPDR == 0x34); //second shift was started right after the latch
+    CHECK(counters[Counter_SPI_STC] - bytes == OUTPUT_BYTES*2);
+    CHECK((SPCR & _BV(SPIE)) == 0);
+}
+
+/* ------------- power lines ------------ */
+
+#define POWER_SWITCHES    (1<<PB6)
+#define POWER_RELAYS    (1<<PB7)
+
+void init_board();
+void recalibrate_switches();
+bool power_ready();
+
+void test_powerUpDoesNotBlock() {
+    storage_saveMask(0x05);
+    sim_ticks(5);
+
+    init_board(); //power up again
+    CHECK((PORTB & (POWER_SWITCHES|POWER_RELAYS)) == 0);
+
+    uint8_t frame[] = { 'G', 0x00 };
+    CHECK(sim_twiWrite(frame, 2) == 2); //bus works during power up
+
+    sim_ticks(6);
+    CHECK((PORTB & (POWER_SWITCHES|POWER_RELAYS)) == POWER_SWITCHES);
+    CHECK(currentOutputStateMask() == 0x00);
+
+    sim_ticks(10);
+    CHECK((PORTB & (POWER_SWITCHES|POWER_RELAYS)) == (POWER_SWITCHES|POWER_RELAYS));
+
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS*2);
+    CHECK(currentOutputStateMask() == 0x05); //restored after relays got power
+}
+
+void test_powerUpKeepsMasterWrites() {
+    storage_saveMask(0x05);
+    sim_ticks(5);
+
+    init_board(); //power up again
+    uint8_t frame[] = { 'o', 0x02 };
+    CHECK(sim_twiWrite(frame, 2) == 2);
+    process_i2c();
+
+    sim_ticks(SIM_POWER_UP_TICKS + OUTPUT_SEQUENCE_SLOT_TICKS*8);
+    CHECK(currentOutputStateMask() == 0x02); //the journal does not undo the master
+}
+
+void test_heldSwitchIsNotLongAfterResume() {
+    InputEvent events[16];
+    bool overflow;
+
+    sim_setInputs(0xFF & ~_BV(2));
+    sim_ticks(50); //long press takes 60
+    readEvents(events, 16, &overflow);
+
+    recalibrate_switches(); //held through it
+    sim_ticks(100);
+    CHECK(power_ready());
+
+    sim_ticks(100);
+    sim_setInputs(0xFF);
+    sim_ticks(50);
+
+    uint8_t count = readEvents(events, 16, &overflow);
+    for ( uint8_t i=0; i<count; i++ ) {
+        CHECK(INPUT_EVENT_TYPE(events[i].info) != Press_Long && INPUT_EVENT_TYPE(events[i].info) != Press_Short);
+    }
+}
+
+void test_recalibrationMasksInputs() {
+    recalibrate_switches();
+    CHECK((PORTB & POWER_SWITCHES) == 0);
+
+    sim_setInputs(0x00); //lines without power
+    sim_ticks(50);
+    CHECK(currentOutputStateMask() == 0x00);
+
+    uint8_t frame[] = { 'S', 0x10 };
+    CHECK(sim_twiWrite(frame, 2) == 2); //bus works during recalibration
+    process_i2c();
+
+    sim_setInputs(0xFF);
+    sim_ticks(30);
+    CHECK(PORTB & POWER_SWITCHES);
+    sim_ticks(10);
+
+    sim_setInputs(0xFF & ~_BV(0)); //switches work again
+    sim_ticks(5);
+    CHECK(currentOutputStateMask() == 0x11);
+}
+
+/* ------------- auto-addressing ------------ */
+
+#define ADDRESS_UNIT  (ADDRESS_PULSE_US/8) //timer0 ticks
+
+// chain position with its inverted crc-4, the same frame the previous board sends;
+// remainder of the position (bit 0 first) times x^4, divided by x^4+x+1
+static uint16_t addressFrame(uint8_t index) {
+    uint16_t remainder = 0x0000;
+    for ( uint8_t i=0; i<8; i++ ) {
+        remainder |= ((index >> i) & 0x01) << (11-i);
+    }
+    for ( int8_t degree=11; degree>=4; degree-- ) {
+        if ( remainder & (1 << degree) ) {
+            remainder ^= 0x13 << (degree-4);
+        }
+    }
+    return index | ((remainder ^ 0x0F) << 8);
+}
+
+// falling edges on the address input, time between them is measured with timer0
+static void receiveAddressFrame(uint16_t frame) {
+    uint8_t now = TCNT0;
+    for ( uint8_t i=0; i<=ADDRESS_FRAME_BITS; i++ ) {
+        if ( i > 0 ) {
+            now += (frame & (1 << (i-1))) ? ADDRESS_UNIT*5 : ADDRESS_UNIT*2;
+        }
+        TCNT0 = now;
+
+        PINC |= ADDRESS_LINE_IN;
+        PCINT1_vect();
+        PINC &= ~ADDRESS_LINE_IN;
+        PCINT1_vect();
+        now = TCNT0; //timer was started by the first edge
+    }
+    PINC |= ADDRESS_LINE_IN;
+}
+
+// run the compare interrupt until the frame is out, returns the decoded bits
+static uint16_t sendAddressFrame(uint16_t *duration) {
+    uint16_t frame = 0x0000;
+    uint8_t edges = 0, lastEdge = 0;
+
+    *duration = 0;
+    while ( TIMSK0 & _BV(OCIE0B) ) {
+        TCNT0 = OCR0B;
+        bool wasHigh = (PORTC & ADDRESS_LINE_OUT) != 0;
+        TIMER0_COMPB_vect();
+
+        if ( wasHigh && (PORTC & ADDRESS_LINE_OUT) == 0 ) { //falling edge
+            uint8_t interval = TCNT0 - lastEdge;
+            if ( edges > 0 ) {
+                *duration += interval;
+                if ( interval > ADDRESS_UNIT*7/2 ) {
+                    frame |= (1 << (edges-1));
+                }
+            }
+            lastEdge = TCNT0;
+            edges++;
+        }
+    }
+
+    return (edges == ADDRESS_FRAME_BITS+1) ? frame : 0xFFFF;
+}
+
+extern uint8_t i2c_address_num;
+void each_5_seconds();
+
+void test_unknownPositionIsNotPassedOn() {
+    each_5_seconds(); //default address, no frame received yet
+    CHECK((TIMSK0 & _BV(OCIE0B)) == 0);
+
+    receiveAddressFrame(addressFrame(0));
+    uint16_t duration;
+    CHECK(sendAddressFrame(&duration) == addressFrame(1));
+    run_pending_tasks(); //position is stored
+
+    init_board(); //power up again
+    each_5_seconds();
+    CHECK(sendAddressFrame(&duration) == addressFrame(1)); //the stored position is known
+}
+
+void test_addressFramesWithoutDelays() {
+    receiveAddressFrame(addressFrame(3));
+    CHECK((TWAR>>1) == ((0x0E<<3) | 3));
+    CHECK(PORTC & INTERRUPT_LINE); //master is told about the new address
+
+    uint16_t duration;
+    CHECK(sendAddressFrame(&duration) == addressFrame(4)); //next device gets position 4
+    CHECK(duration < 500); //less than 4ms
+    CHECK((PORTC & ADDRESS_LINE_OUT) == 0);
+
+    uint16_t errors[] = { 0x100, 0x006, 0x180 }; //one bit, then one late edge in the position and at the crc
+    for ( uint8_t i=0; i<3; i++ ) {
+        TIMER0_OVF_vect();
+        TIMER0_OVF_vect();
+        receiveAddressFrame(addressFrame(5) ^ errors[i]);
+        CHECK((TWAR>>1) == ((0x0E<<3) | 3));
+    }
+
+    TIMER0_OVF_vect();
+    TIMER0_OVF_vect();
+    receiveAddressFrame(addressFrame(20)); //past the 8th board
+    CHECK((TWAR>>1) == 0x10 + 20-8);
+    CHECK(sendAddressFrame(&duration) == addressFrame(21));
+
+    run_pending_tasks();
+    CHECK(i2c_address_num == 0x10 + 20-8); //written by housekeeping
+
+    uint8_t select[] = { 'r', 0x09 };
+    sim_twiWrite(select, 2);
+    uint8_t index;
+    sim_twiRead(&index, 1);
+    CHECK(index == 20);
+
+    each_5_seconds(); //repeated for a hot-plugged next board
+    CHECK(sendAddressFrame(&duration) == addressFrame(21));
+    CHECK(sim_delayedMicroseconds == 0); //nothing was waiting inside interrupts
+
+    TIMER0_OVF_vect();
+    TIMER0_OVF_vect();
+    receiveAddressFrame(addressFrame(0x67)); //the last position, 0x6F
+    CHECK((TWAR>>1) == 0x6F);
+    CHECK((TIMSK0 & _BV(OCIE0B)) == 0); //nothing to pass on
+
+    TIMER0_OVF_vect();
+    TIMER0_OVF_vect();
+    receiveAddressFrame(addressFrame(0x68)); //past the end of the chain
+    CHECK((TWAR>>1) == 0x6F);
+    CHECK((TIMSK0 & _BV(OCIE0B)) == 0);
+    CHECK(counters[Counter_ChainOverflows] == 1);
+
+    each_5_seconds();
+    CHECK((TIMSK0 & _BV(OCIE0B)) == 0);
+}
+
+/* ------------- main loop ------------ */
+
+void go_to_sleep();
+
+extern volatile bool needsEepromSave;
+extern volatile bool outputStateNeedsToBeSaved;
+
+// the same as the main loop does, sleep mode is left in SMCR
+static void loop_until_sleep() {
+    while ( dispatch_pending(0xFF) ) {
+        run_pending_tasks();
+        sim_spi(); //shift is over in a few cycles
+    }
+    go_to_sleep();
+}
+
+void test_onlyPendingTasksRun() {
+    loop_until_sleep();
+    CHECK(dispatch_take() == 0x00);
+
+    uint8_t frame[] = { 'S', 0x21 };
+    sim_twiWrite(frame, 2);
+    CHECK(dispatch_pending(Task_I2C));
+    CHECK(!dispatch_pending(Task_Output | Task_Interface | Task_Housekeeping));
+
+    needsEepromSave = outputStateNeedsToBeSaved = true;
+    dispatch_post(Task_Housekeeping);
+
+    run_pending_tasks();
+    CHECK(dispatch_pending(Task_Output)); //command has changed the relays
+    CHECK(needsEepromSave); //housekeeping waits for commands
+
+    run_pending_tasks();
+    CHECK(!needsEepromSave);
+    CHECK(storage_busy());
+    CHECK(dispatch_take() == 0x00);
+
+    uint8_t select[] = { 'r', 0x00 };
+    sim_twiWrite(select, 2);
+    uint8_t mask;
+    sim_twiRead(&mask, 1);
+    CHECK(mask == 0x21); //registers were updated after the command
+}
+
+void test_stateIsSavedAfterSequence() {
+    sim_ticks(1); //power-up journal record is out of the way
+    setOutputStateMaskSlowly(0x0F);
+    sim_ticks(1);
+    CHECK(output_sequenceActive());
+
+    needsEepromSave = outputStateNeedsToBeSaved = true;
+    housekeeping();
+    CHECK(needsEepromSave && !storage_busy()); //not written, still wanted
+
+    sim_ticks(OUTPUT_SEQUENCE_SLOT_TICKS*4);
+    CHECK(!output_sequenceActive());
+
+    each_5_seconds();
+    CHECK(dispatch_pending(Task_Housekeeping));
+    housekeeping();
+    CHECK(!needsEepromSave && storage_busy());
+}
+
+#define SLEEP_MODE_MASK ((1<<SM0)|(1<<SM1)|(1<<SM2))
+
+void test_powerDownWhenNothingIsTimed() {
+    loop_until_sleep();
+    CHECK((SMCR & SLEEP_MODE_MASK) == (1<<SM1)); //power down
+    CHECK(WDTCSR & _BV(WDIE)); //watchdog wakes us up instead of reset
+
+    setOutputStateMask(0x04);
+    run_pending_tasks();
+    go_to_sleep();
+    CHECK((SMCR & SLEEP_MODE_MASK) == 0); //SPI clock would stop in power down
+    sim_spi();
+
+    uint8_t frame[] = { 's', 0x13 };
+    sim_twiWrite(frame, 2);
+
+    loop_until_sleep();
+    CHECK((SMCR & SLEEP_MODE_MASK) == 0); //command led is still on, idle
+
+    sim_ticks(5);
+    loop_until_sleep();
+    CHECK((SMCR & SLEEP_MODE_MASK) == (1<<SM1));
+    CHECK(currentOutputStateMask() == 0x04);
+
+    sim_setInputs(0xFF & ~_BV(1));
+    loop_until_sleep();
+    CHECK((SMCR & SLEEP_MODE_MASK) == 0); //switch is being debounced
+
+    sim_ticks(10);
+    sim_setInputs(0xFF);
+    sim_ticks(30);
+    loop_until_sleep();
+    CHECK((SMCR & SLEEP_MODE_MASK) == 0); //interrupt line is raised for a while
+
+    CHECK(sim_delayedMicroseconds == 0); //no fixed delays in the loop
+}
+
+/* ------------- eeprom journal ------------ */
+
+void test_journalSkipsUnchangedStates() {
+    uint32_t writes = sim_eepromWrites;
+
+    storage_saveMask(0x11);
+    CHECK(sim_eepromWrites == writes); //nothing is written until eeprom interrupt
+    sim_ticks(JOURNAL_RECORD_SIZE+2);
+    CHECK(sim_eepromWrites == writes+JOURNAL_RECORD_SIZE);
+
+    storage_saveMask(0x11);
+    sim_ticks(JOURNAL_RECORD_SIZE+2);
+    CHECK(sim_eepromWrites == writes+JOURNAL_RECORD_SIZE);
+}
+
+void test_journalFindsNewestRecord() {
+    for ( int i=0; i<200; i++ ) { //wraps around the journal and sequence numbers
+        storage_saveMask(i);
+        sim_ticks(JOURNAL_RECORD_SIZE+1);
+    }
+    CHECK(!storage_busy());
+
+    OutputMask mask = 0x00;
+    init_storage();
+    CHECK(storage_restoreMask(&mask) && mask == 199);
+}
+
+void test_journalKeepsLatestPendingState() {
+    storage_saveMask(0x01);
+    storage_saveMask(0x02);
+    storage_saveMask(0x03);
+    sim_ticks(JOURNAL_RECORD_SIZE*3);
+
+    OutputMask mask = 0x00;
+    init_storage();
+    CHECK(storage_restoreMask(&mask) && mask == 0x03);
+}
+
+void test_journalIgnoresTornRecord() {
+    storage_saveMask(0x42);
+    sim_ticks(JOURNAL_RECORD_SIZE+2);
+    storage_saveMask(0x24);
+    sim_ticks(1); //power is lost after the first byte
+
+    OutputMask mask = 0x00;
+    init_storage();
+    CHECK(storage_restoreMask(&mask) && mask == 0x42);
+}
+
+/* ---------------------------------------- */
+
+typedef void (*TestFunction)();
+
+// every test runs in its own process, so firmware starts from the power-up state
+int run(const char *name, TestFunction test) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+        sim_reset();
+        test();
+        fflush(stdout);
+        _exit(sim_failures != 0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    bool passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("%s %s\n", passed ? "PASS" : "FAIL", name);
+
+    return passed ? 0 : 1;
+}
+
+#define RUN(test) failed += run(#test, test)
+
+int main() {
+    int failed = 0;
+
+    RUN(test_singleCommand);
+    RUN(test_burstWrite);
+    RUN(test_burstStopsAtZeroCommand);
+    RUN(test_commandsAreValidated);
+    RUN(test_chainedRegisters);
+    RUN(test_fullQueueIsNacked);
+    RUN(test_generalCallForGroups);
+    RUN(test_stagedOutputsCommitTogether);
+    RUN(test_scenesFromCache);
+    RUN(test_queueStatsRegisters);
+    RUN(test_readCommandFromInterrupt);
+    RUN(test_registerBlock);
+    RUN(test_countersOverI2C);
+    RUN(test_watchdogResetsAreKept);
+    RUN(test_debouncedToggle);
+    RUN(test_simultaneousPresses);
+    RUN(test_pressClassification);
+    RUN(test_eventsOverflow);
+    RUN(test_localRules);
+    RUN(test_timersSwitchOutputsOff);
+    RUN(test_sequenceDoesNotBlock);
+    RUN(test_sequenceIsSuperseded);
+    RUN(test_outputShiftedFromInterrupt);
+    RUN(test_powerUpDoesNotBlock);
+    RUN(test_powerUpKeepsMasterWrites);
+    RUN(test_heldSwitchIsNotLongAfterResume);
+    RUN(test_recalibrationMasksInputs);
+    RUN(test_unknownPositionIsNotPassedOn);
+    RUN(test_addressFramesWithoutDelays);
+    RUN(test_onlyPendingTasksRun);
+    RUN(test_stateIsSavedAfterSequence);
+    RUN(test_powerDownWhenNothingIsTimed);
+    RUN(test_journalSkipsUnchangedStates);
+    RUN(test_journalFindsNewestRecord);
+    RUN(test_journalKeepsLatestPendingState);
+    RUN(test_journalIgnoresTornRecord);
+
+    printf("%d failed\n", failed);
+    return failed != 0;
+}
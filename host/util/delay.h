@@ -0,0 +1,16 @@
+/* ------------------------------------- 
+	<util/delay.h> (host build)
+	• delays return right away, but add up to the simulated time
+------------------------------------- */
+
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+#include <stdint.h>
+
+extern volatile uint32_t sim_delayedMicroseconds;
+
+#define _delay_ms(ms) (sim_delayedMicroseconds += (uint32_t)((ms)*1000))
+#define _delay_us(us) (sim_delayedMicroseconds += (uint32_t)(us))
+
+#endif
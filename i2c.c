@@ -7,70 +7,100 @@
 #include <avr/wdt.h>
 
 #include "i2c.h"
+#include "dispatch.h"
+#include "counters.h"
+#include "commands.h"
 
-#define MAX_READ_COMMANDS           8
-#define WRITE_COMMANDS_QUEUE_SIZE   8
+#define QUEUE_MASK                  (I2C_COMMANDS_QUEUE_SIZE-1)
 
-volatile char allReadCommands[MAX_READ_COMMANDS];
+#if (I2C_COMMANDS_QUEUE_SIZE & QUEUE_MASK) != 0 || I2C_COMMANDS_QUEUE_SIZE > 128
+    #error "I2C_COMMANDS_QUEUE_SIZE has to be a power of two, up to 128"
+#endif
 
-// every command consists of command type and argument byte
+// compiler must not move queue accesses across index updates
+#define MEMORY_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+// every command consists of command type and argument byte,
+// command byte is replaced with its id from the commands table
 typedef struct { 
-   char command;
+   uint8_t command;
    uint8_t data;    
+   bool first; //the first write command of its transaction
 } RemoteCommand; 
 
-// generic queue for both read and write commands
-volatile RemoteCommand commandQueue[WRITE_COMMANDS_QUEUE_SIZE];
+// queue for write commands, read commands never get here,
+// interrupt is the only writer and the main loop is the only reader
+RemoteCommand commandQueue[I2C_COMMANDS_QUEUE_SIZE];
 
-// index of the last-written and next-to-be-read elements
+// free running indices of the next-to-be-read and next-to-be-written elements,
+// each one is a single byte, so it is published with one store
 volatile uint8_t qHead = 0; 
 volatile uint8_t qTail = 0;
 
-// result of the last read command
-volatile uint8_t readResultByte = 0x00;
+// the most commands waiting at once, refused frames are in Counter_QueueFull
+volatile uint8_t qHighWater = 0;
+
+// last read command, it is resolved inside the interrupt on SLA+R
+volatile RemoteCommand readCommand = {0x00, 0x00, false};
 
-// useful macro to get array size
-#define N_ELEMS(x) (sizeof(x)/sizeof((x)[0]))
+// register block, which is read by the master directly from the interrupt
+volatile uint8_t registers[I2C_REGISTERS_COUNT];
+volatile bool registerMode = false; //last write has selected a register
+volatile uint8_t registerPointer = 0x00; //first register for the next SLA+R
+
+// group membership, copied from eeprom by the main loop
+volatile uint8_t groups[I2C_GROUPS_COUNT];
+volatile bool generalCall = false; //current transaction is for a group
 
 /* ------------- basic queue commands ------------ */
 
-static inline uint8_t i2c_commandQueueEmpty() { 
-   return (qHead == qTail); 
+static inline uint8_t i2c_commandQueueDepth() { 
+   return (uint8_t)(qTail - qHead); 
 } 
 
-static inline uint8_t i2c_commandQueueFull() { 
-   return (qHead == (qTail + 1) % N_ELEMS(commandQueue)); 
+static inline bool i2c_commandQueueFull() { 
+   return (i2c_commandQueueDepth() == I2C_COMMANDS_QUEUE_SIZE); 
 }
 
+// called from interrupt only
 static inline void i2c_commandEnqueue(RemoteCommand *command) { 
-   commandQueue[qTail] = *command; 
-   qTail = (qTail + 1) % N_ELEMS(commandQueue); 
-}
-
-static inline void i2c_lastCommand(RemoteCommand *command) { 
-    *command = commandQueue[qHead]; 
+   uint8_t tail = qTail;
+   commandQueue[tail & QUEUE_MASK] = *command; 
+   MEMORY_BARRIER();
+   qTail = ++tail; //element is visible to the main loop from now on
+
+   uint8_t depth = (uint8_t)(tail - qHead);
+   if ( depth > qHighWater ) {
+       qHighWater = depth;
+   }
 }
 
+// called from main loop only, queue must not be empty
 static inline void i2c_commandDequeue(RemoteCommand *command) { 
-   *command = commandQueue[qHead]; 
-   qHead = (qHead + 1) % N_ELEMS(commandQueue); 
+   uint8_t head = qHead;
+   MEMORY_BARRIER();
+   *command = commandQueue[head & QUEUE_MASK]; 
+   MEMORY_BARRIER();
+   qHead = head + 1; //slot can be written again
 }
 
-/* ---------------------------------------------- */
+/* ------------- groups ------------ */
 
-// check the command against array of previously declared read commands
-bool i2c_isReadCommand(char command) {
-    for ( int i=0; i<MAX_READ_COMMANDS; i++ ) {
-        char readCmd = allReadCommands[i];
-        if ( readCmd == 0x00 ) {
-            break;
-        } else if (readCmd == command) {
+static bool i2c_isGroupMember(uint8_t group) {
+    if ( group == I2C_GROUP_ALL ) {
+        return true;
+    }
+
+    for ( uint8_t i=0; i<I2C_GROUPS_COUNT; i++ ) {
+        if ( groups[i] == group && group != I2C_GROUP_NONE ) {
             return true;
         }
     }
     return false;
 }
 
+/* ---------------------------------------------- */
+
 // all i2c bus states
 enum {
     BusIdle = 0x00,
@@ -78,7 +108,8 @@ enum {
     // slave receiver
     BusWillReceiveCommand = 0x01,
     BusReceivedCommand = 0x02,
-    BusReceivedArgumentByte = 0x03,
+    BusQueueFull = 0x03, //next byte is not acknowledged
+    BusWillReceiveGroup = 0x04, //general call, group id comes first
 
     // slave transmitter
     BusRequestedReadCommand = 0x21,
@@ -86,12 +117,17 @@ enum {
 
 } BusStates;
 
+volatile char bus_state = BusIdle; //tells the main loop whether a transaction is in progress
+
 /* ------------- global i2c routine ------------- */
 ISR(TWI_vect){    
     cli();
+    counters_increment(Counter_TWI);
 
-    static char bus_state = BusIdle;
-    static RemoteCommand currentCommand = {0x00, 0x00}; //store current command between interrupt calls
+    static RemoteCommand currentCommand = {0x00, 0x00, false}; //store current command between interrupt calls
+    static bool firstInTransaction = false; //no write command was queued since SLA+W yet
+    static uint8_t readIndex = 0x00; //next byte of the answer to transmit
+    static uint8_t registerSnapshot[I2C_REGISTERS_COUNT]; //registers are frozen for the whole read transaction
 
     //useful macros for TWI 
     uint8_t status = (TWSR & 0xF8); //only 5 msb store status value
@@ -106,34 +142,96 @@ ISR(TWI_vect){
     case TW_SR_SLA_ACK:
     case TW_SR_ARB_LOST_SLA_ACK: 
     //we have been addressed, become slave receiver
+       generalCall = false;
+       firstInTransaction = true;
        if ( i2c_commandQueueFull() ) {
-            bus_state = BusIdle; 
-            NACK(); //do not receive any commands if we can't put them on queue
+            bus_state = BusQueueFull; 
+            NACK(); //address is acknowledged, but no command is received until queue has room
        } else {
             bus_state = BusWillReceiveCommand; 
             ACK();            
        }  
        break;
 
+    case TW_SR_GCALL_ACK:
+    case TW_SR_ARB_LOST_GCALL_ACK:
+    //general call, it's for us only if we are in the group
+       generalCall = true;
+       firstInTransaction = true;
+       if ( i2c_commandQueueFull() ) {
+            bus_state = BusQueueFull;
+            NACK(); //other members may still take it
+       } else {
+            bus_state = BusWillReceiveGroup;
+            ACK();
+       }
+       break;
+
+    case TW_SR_GCALL_DATA_ACK:
+        if ( bus_state == BusWillReceiveGroup ) {
+            if ( i2c_isGroupMember(TWDR) ) {
+                bus_state = BusWillReceiveCommand; //the rest is the same as for our own address
+                ACK();
+            } else {
+                bus_state = BusIdle;
+                NACK(); //not our group, ignore the rest
+            }
+            break;
+        }
+        //no break, commands of a group frame
+
     case TW_SR_DATA_ACK:
     // data has been received in slave receiver mode
         if ( bus_state == BusWillReceiveCommand ) { //are waiting for a first byte?
-            if ( TWDR != 0x00 ) { 
-                currentCommand.command = TWDR; //first byte is command type
+            uint8_t id = commands_lookup(TWDR); //first byte is command type
+            if ( id != CommandId_None ) { 
+                currentCommand.command = id;
                 currentCommand.data = 0x00;
                 bus_state = BusReceivedCommand;                
                 ACK();     
             } else {
-                //0x00 is either ping or an invalid command 
+                //0x00 is either ping or the end of a burst, anything else is an unknown command
+                if ( TWDR != 0x00 ) {
+                    counters_increment(Counter_InvalidCommands);
+                }
                 bus_state = BusIdle;
                 NACK();
             } 
         } else if ( bus_state == BusReceivedCommand) { //first byte received, we are waiting for the second byte
             currentCommand.data = TWDR; //second byte is an argument
-            i2c_commandEnqueue(&currentCommand); //queue full command (2 bytes)
-            currentCommand = (RemoteCommand){0, 0};
-            bus_state = BusReceivedArgumentByte;
-            ACK();            
+
+            if ( !commands_validArgument(currentCommand.command, currentCommand.data) ) {
+                counters_increment(Counter_InvalidCommands); //drop it, but keep receiving the burst
+            } else if ( generalCall && commands_kind(currentCommand.command) != Command_Write ) {
+                counters_increment(Counter_InvalidCommands); //many boards can't answer one read
+            } else switch ( commands_kind(currentCommand.command) ) {
+                case Command_Register:
+                    registerPointer = currentCommand.data; //no need for the main loop, next reads come from registers
+                    registerMode = true;
+                    break;
+                case Command_Read:
+                    readCommand.command = currentCommand.command; //do not wait for the main loop, answer on the next SLA+R
+                    readCommand.data = currentCommand.data;
+                    registerMode = false;
+                    break;
+                default:
+                    currentCommand.first = firstInTransaction;
+                    firstInTransaction = false;
+                    i2c_commandEnqueue(&currentCommand); //queue full command (2 bytes)
+                    dispatch_post(Task_I2C);
+                    registerMode = false;
+                    break;
+            }
+            currentCommand = (RemoteCommand){0, 0, false};
+
+            // burst mode: the same transaction may carry more (command, argument) pairs
+            if ( i2c_commandQueueFull() ) {
+                bus_state = BusQueueFull;
+                NACK(); //no room for the next pair, master has to start a new transaction
+            } else {
+                bus_state = BusWillReceiveCommand;
+                ACK();
+            }
         } else {
             NACK(); //wft was that?
         }
@@ -142,13 +240,19 @@ ISR(TWI_vect){
 
     case TW_SR_DATA_NACK:
     case TW_SR_GCALL_DATA_NACK:
-        // data received,  but master returned nack
-        NACK(); // nack back at master
+        // we have not acknowledged the last byte, transaction is over
+        if ( bus_state == BusQueueFull ) {
+            counters_increment(Counter_QueueFull); //master wanted to send one more frame
+            dispatch_post(Task_Registers);
+        }
+        bus_state = BusIdle;
+        ACK(); //keep listening to our address, otherwise slave goes deaf
         break;
 
     case TW_SR_STOP:
         ACK(); //okay, move on
         bus_state = BusIdle;
+        currentCommand = (RemoteCommand){0, 0, false}; //drop unfinished pair, if any
         break;
 
 
@@ -157,29 +261,58 @@ ISR(TWI_vect){
     case TW_ST_ARB_LOST_SLA_ACK:
     //we have been addressed with SLA+R
         bus_state = BusRequestedReadCommand;
+        readIndex = 0; //every read starts from the first byte of the answer
+
+        if ( registerMode ) {
+            for ( uint8_t i=0; i<I2C_REGISTERS_COUNT; i++ ) {
+                registerSnapshot[i] = registers[i]; //main loop can't change them in the middle of the read
+            }
+        }
+        //no break, send the first byte
 
-        TWDR = readResultByte; //return master the result of the last read command
-        readResultByte = 0x00;
+    case TW_ST_DATA_ACK:
+    //master wants one more byte
+        if ( registerMode ) {
+            uint8_t reg = registerPointer + readIndex++; //auto-increment
+            TWDR = (reg < I2C_REGISTERS_COUNT) ? registerSnapshot[reg] : 0x00;
 
-        NACK(); //we're only sending one byte, nack = end.
+            if ( reg+1 < I2C_REGISTERS_COUNT ) {
+                ACK(); //there are more registers to read
+            } else {
+                NACK(); //that was the last one
+            }
+        } else {
+            uint8_t result = 0x00;
+            bool hasMoreBytes = false;
+            if ( readCommand.command != CommandId_None ) {
+                hasMoreBytes = commands_executeRead(readCommand.command, readCommand.data, readIndex++, &result); //resolve it right now
+            }
+            TWDR = result; //return master the result of the last read command
+
+            if ( hasMoreBytes ) {
+                ACK(); //answer is longer than one byte
+            } else {
+                NACK(); //nack = end.
+            }
+        }
         break;
 
     case TW_ST_LAST_DATA:
-    case TW_ST_DATA_ACK:
     case TW_ST_DATA_NACK:
         bus_state = BusTransmittedRequestedValue;
-        NACK(); // okay, no more bytes
+        ACK(); // okay, no more bytes, but keep listening to our address
         break;
 
     default:
         // everything is okay or terribly wrong with the bus, reset state
+        counters_increment(Counter_BusErrors);
         bus_state = BusIdle;
         currentCommand = (RemoteCommand) {0x00, 0x00};
         ACK(); //just in case
         break;
     }  
 
-    TWCR |= twi_ctrl; //set all bit at once
+    TWCR = twi_ctrl; //set all bits at once, TWEA has to be cleared for NACK
 
    sei();
 }
@@ -201,37 +334,60 @@ void init_i2c(uint8_t address){
 
 // tell main loop that we have some commands to process
 bool i2c_commandsAvailable() {
-    return !i2c_commandQueueEmpty();
+    return (qHead != qTail);
 }
 
-// used by main.c to tell which commands should be treaded as a read commands
-void i2c_setReadCommands(char commands[], uint8_t numCommands) {
-    for ( int i=0; i<MAX_READ_COMMANDS; i++ ) {
-        if ( i<numCommands ) {
-            allReadCommands[i] = commands[i];
-        } else {
-            allReadCommands[i] = 0x00;
-        }
+uint8_t i2c_queueDepth() {
+    return i2c_commandQueueDepth();
+}
+
+uint8_t i2c_queueHighWater() {
+    return qHighWater;
+}
+
+uint8_t i2c_rejectedFrames() {
+    return (counters[Counter_QueueFull] & 0xFF); //single byte, always consistent
+}
+
+// master has addressed us and the transaction is not over yet
+bool i2c_busy() {
+    switch ( bus_state ) {
+        case BusIdle:
+        case BusTransmittedRequestedValue:
+            return false;
+        default:
+            return true;
     }
 }
 
-// main loop processing
+// registers are copied at the start of every read, so multi-byte values
+// should be updated with interrupts disabled
+void i2c_setRegister(uint8_t reg, uint8_t value) {
+    if ( reg < I2C_REGISTERS_COUNT ) {
+        registers[reg] = value;
+    }
+}
+
+uint8_t i2c_group(uint8_t slot) {
+    return (slot < I2C_GROUPS_COUNT) ? groups[slot] : I2C_GROUP_NONE;
+}
+
+void i2c_setGroup(uint8_t slot, uint8_t group) {
+    if ( slot < I2C_GROUPS_COUNT ) {
+        groups[slot] = (group == I2C_GROUP_ALL) ? I2C_GROUP_NONE : group; //single byte, interrupt sees old or new one
+    }
+}
+
+// main loop processing, only write commands are queued
 void process_i2c() {    
     while ( i2c_commandsAvailable() ) { //process all commands, so buffer doesn't get filled
         RemoteCommand cmd;
         i2c_commandDequeue(&cmd);
 
-        // both read and write functions are weak, check against them
-        if ( i2c_isReadCommand(cmd.command) && i2c_executeReadCommand != NULL )
-        {
-            uint8_t result = 0x00;
-            i2c_executeReadCommand(cmd.command, cmd.data, &result); //get result back from main.c
-            readResultByte = result; //store result for the next SLA+R operation
-        }
-        else if ( i2c_executeWriteCommand != NULL )
-        {
-            i2c_executeWriteCommand(cmd.command, cmd.data); //let the main.c code execute that command
+        if ( cmd.first && i2c_transactionStarted ) { //it's a weak function
+            i2c_transactionStarted();
         }
+        commands_executeWrite(cmd.command, cmd.data); //table lookup, handler is in main.c
 
         wdt_reset(); //we're in a loop, so don't forget to feed the dog
     }
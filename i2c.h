@@ -1,10 +1,31 @@
 /* ------------------------------------- 
 	<i2c.h>
 	• act as a I2C slave with a programmable address
-	• maintain read&write commands queue
-	• execute commands in the main loop
+	• maintain write commands queue
+	• accept several commands in one transaction (burst mode)
+	• execute write commands in the main loop
+	• answer read commands right from the interrupt
+	• serve a register block to the master with auto-increment reads
+	• commands are classified by the table in commands.h
+	• general call carries write commands for a group of boards
 ------------------------------------- */
 
+/* QUEUE */
+#ifndef I2C_COMMANDS_QUEUE_SIZE
+    #define I2C_COMMANDS_QUEUE_SIZE 16 //write commands, power of two up to 128
+#endif
+
+/* REGISTERS */
+#define I2C_REGISTERS_COUNT     16  //size of the register block
+
+/* GROUPS */
+// general call frame: group id, then (command, argument) pairs as usual,
+// only members of the group take it, read commands are not allowed there
+#define I2C_GROUPS_COUNT        4     //groups one board can be a member of
+#define I2C_GROUP_NONE          0x00  //free slot, erased eeprom (0xFF) is a free slot too
+#define I2C_GROUP_ALL           0xFF  //every board is a member
+// 0x04 and 0x06 are general call codes from the i2c specification, better not use them as group ids
+
 /* INTERRUPTS */
 ISR(TWI_vect);
 
@@ -15,11 +36,27 @@ void process_i2c(); //process commands in a loop
 // check whether i2c commands queue is not empty
 bool i2c_commandsAvailable(); 
 
-// declare which commands should be treated as a read commands
-void i2c_setReadCommands(char commands[], uint8_t numCommands);
+// write commands waiting in the queue
+uint8_t i2c_queueDepth();
+
+// the most write commands waiting at once since power up
+uint8_t i2c_queueHighWater();
+
+// frames not acknowledged because the queue was full, wraps around
+uint8_t i2c_rejectedFrames();
+
+// check whether a transaction is in progress, clocks should keep running until it's over
+bool i2c_busy();
+
+// publish a new value to the register block, master can read it at any time
+void i2c_setRegister(uint8_t reg, uint8_t value);
+
+// group id in a membership slot, I2C_GROUP_NONE for a free one
+uint8_t i2c_group(uint8_t slot);
 
-// OVERRIDE: execute write command (change something)
-void i2c_executeWriteCommand(char command, uint8_t intputData) __attribute__((weak));
+// change a membership slot, takes effect with the next general call
+void i2c_setGroup(uint8_t slot, uint8_t group);
 
-// OVERRIDE: execute read command (store result in a buffer)
-void i2c_executeReadCommand(char command, uint8_t argument, volatile uint8_t *outputData) __attribute__((weak));
+// OVERRIDE: called from the main loop before the first write command of every transaction,
+// state that should not outlive one transaction is reset here
+void i2c_transactionStarted() __attribute__((weak));
@@ -5,27 +5,189 @@
 #include <stdbool.h> 
 
 #include "input.h"
+#include "systick.h"
+#include "dispatch.h"
+#include "counters.h"
 
 #define INPUT_PORT   	PIND //all pins in PORTD are used to capture switch events
 
-static volatile uint8_t prevPortValue = 0x00;
+// press classification timings, in system ticks
+#define LONG_PRESS_TICKS    (600/(1000/SYSTICK_HZ))  //hold longer than this for a long press
+#define DOUBLE_PRESS_TICKS  (300/(1000/SYSTICK_HZ))  //max gap between two presses of a double press
 
-// capture any pin change event in a PORTD
+// debouncer state: 2-bit vertical counter for every pin
+static volatile uint8_t debouncedPort = 0xFF;
+static uint8_t counterBit0 = 0x00, counterBit1 = 0x00;
+
+// press classification state
+static volatile bool samplingActive = false;
+static uint8_t pinTicks[8]; //hold time while pressed, gap time while waiting for a double press
+static uint8_t waitingSecondPress = 0x00; //released, short press unless a second press comes in time
+static uint8_t pressConsumed = 0x00; //long or double press reported, no short press on release
+
+// events ring buffer, filled from interrupts and drained by the master
+static volatile InputEvent eventsQueue[INPUT_EVENTS_QUEUE_SIZE];
+static volatile uint8_t eventsHead = 0; //next to be read
+static volatile uint8_t eventsTail = 0; //next to be written
+static volatile bool eventsOverflow = false;
+
+/* ------------- events queue ------------ */
+
+// indices run freely, so the queue can hold all INPUT_EVENTS_QUEUE_SIZE elements
+uint8_t input_eventsCount() {
+    return (uint8_t)(eventsTail - eventsHead);
+}
+
+// called from interrupts only
+static void input_pushEvent(uint8_t info, uint16_t time) {
+    if ( input_eventsCount() >= INPUT_EVENTS_QUEUE_SIZE ) {
+        eventsOverflow = true; //keep the oldest events, report lost ones
+        return;
+    }
+
+    volatile InputEvent *event = &eventsQueue[eventsTail & (INPUT_EVENTS_QUEUE_SIZE-1)];
+    event->info = info;
+    event->time = time;
+    eventsTail++;
+
+    dispatch_post(Task_Registers); //levels and pending events have changed
+}
+
+bool input_popEvent(InputEvent *event) {
+    bool result = false;
+
+    uint8_t sreg = SREG;
+    cli();
+    if ( eventsHead != eventsTail ) {
+        volatile InputEvent *oldest = &eventsQueue[eventsHead & (INPUT_EVENTS_QUEUE_SIZE-1)];
+        event->info = oldest->info;
+        event->time = oldest->time;
+        eventsHead++;
+        result = true;
+        dispatch_post(Task_Registers);
+    }
+    SREG = sreg;
+
+    return result;
+}
+
+bool input_eventsOverflowed() {
+    uint8_t sreg = SREG;
+    cli();
+    bool result = eventsOverflow;
+    eventsOverflow = false;
+    SREG = sreg;
+
+    return result;
+}
+
+/* --------------------------------------- */
+
+// any pin change in a PORTD only wakes up the sampling, debouncer does the rest
 ISR(PCINT2_vect) { 
-    uint8_t newPort = INPUT_PORT;
-    uint8_t m = prevPortValue ^ newPort; //find which bit has been changed since last interrupt
+    counters_increment(Counter_PCINT2);
+    PCICR &= ~(1<<PCIE2); //no more interrupts from bouncing contacts, until inputs are stable again
+    samplingActive = true;
+}
 
-    if ( (newPort & m) == 0 && m != 0 ) //something changed from 1 to 0
-    {    
-        //find which bit changed and convert bit mask to pin number
-        int pinNumber = (m&0x1?0:m&0x2?1:m&0x4?2:m&0x8?3:m&0x10?4:m&0x20?5:m&0x40?6:7);
+// record event and let the main.c code handle the trigger, releases are only recorded
+static void input_report(uint8_t number, uint8_t edge, uint8_t pressType, uint16_t now) {
+    input_pushEvent(number | edge | (pressType<<4), now);
 
-        if ( input_trigger ) { //it's a weak function
-        	input_trigger(pinNumber); //let the main.c code handle the trigger
+    if ( input_trigger && (edge || pressType != Press_Edge) ) { //it's a weak function
+        input_trigger(number, pressType);
+    }
+}
+
+// called on every system tick, all 8 pins are debounced at once
+void input_sample() {
+    if ( !samplingActive ) {
+        return;
+    }
+
+    //vertical counter: bit in debouncedPort toggles after 4 equal samples in a row
+    uint8_t delta = INPUT_PORT ^ debouncedPort;
+    counterBit1 = (counterBit1 ^ counterBit0) & delta;
+    counterBit0 = ~counterBit0 & delta;
+
+    uint8_t changed = delta & ~(counterBit0 | counterBit1);
+    debouncedPort ^= changed;
+
+    uint8_t pressed = ~debouncedPort; //low level = active switch
+    uint8_t activePins = changed | pressed | waitingSecondPress;
+
+    if ( activePins != 0x00 ) {
+        uint16_t now = systick_now();
+
+        for ( uint8_t i=0; i<8; i++ ) {
+            uint8_t bit = _BV(i);
+            if ( (activePins & bit) == 0 ) {
+                continue;
+            }
+
+            if ( changed & bit ) {
+                if ( pressed & bit ) { //switch became active
+                    input_report(i, INPUT_EVENT_PRESSED, Press_Edge, now);
+
+                    if ( waitingSecondPress & bit ) {
+                        waitingSecondPress &= ~bit;
+                        pressConsumed |= bit;
+                        input_report(i, INPUT_EVENT_PRESSED, Press_Double, now);
+                    }
+                    pinTicks[i] = 0;
+                } else { //switch released
+                    input_report(i, 0x00, Press_Edge, now);
+
+                    if ( (pressConsumed & bit) == 0 ) {
+                        waitingSecondPress |= bit; //short or the first of a double, the window tells
+                    }
+                    pressConsumed &= ~bit;
+                    pinTicks[i] = 0;
+                }
+            } else if ( pressed & bit ) { //still holding
+                if ( pinTicks[i] < LONG_PRESS_TICKS && ++pinTicks[i] == LONG_PRESS_TICKS ) {
+                    pressConsumed |= bit;
+                    input_report(i, INPUT_EVENT_PRESSED, Press_Long, now);
+                }
+            } else if ( ++pinTicks[i] >= DOUBLE_PRESS_TICKS ) { //no second press in time
+                waitingSecondPress &= ~bit;
+                input_report(i, 0x00, Press_Short, now);
+            }
         }
     }
 
-    prevPortValue = newPort; //store current value for the next call
+    //everything is stable, wait for the next pin change
+    if ( delta == 0x00 && pressed == 0x00 && waitingSecondPress == 0x00 ) {
+        samplingActive = false;
+        PCICR |= (1<<PCIE2); //pending pin change flag will fire right away, if any
+    }
+}
+
+// debouncer needs system ticks until all switches are stable
+bool input_sampling() {
+    return samplingActive;
+}
+
+// ignore switch lines, e.g. while switches have no power
+void input_suspend() {
+    PCICR &= ~(1<<PCIE2);
+    samplingActive = false;
+}
+
+// start listening again, lines which are active right now do not count as presses
+void input_resume() {
+    debouncedPort = INPUT_PORT;
+    counterBit0 = counterBit1 = 0x00;
+    waitingSecondPress = 0x00;
+    pressConsumed = ~debouncedPort; //no short press on their release
+
+    //held lines are not presses, they never become long ones either
+    for ( uint8_t i=0; i<8; i++ ) {
+        pinTicks[i] = (pressConsumed & _BV(i)) ? LONG_PRESS_TICKS : 0;
+    }
+
+    PCIFR = (1<<PCIF2); //forget old pin changes
+    PCICR |= (1<<PCIE2);
 }
 
 // basic IO setup
@@ -33,14 +195,14 @@ void init_input_ports() {
     DDRD = 0x00;  //port D is for pin change interrupts (=input, high-z)
     PORTD = 0xFF; //enable pull-up
 
-    prevPortValue = INPUT_PORT;
+    debouncedPort = INPUT_PORT;
 
     //enable pin change interrupts
     PCMSK2 = 0xFF; //port D is 8-bit input, all pins PCINT16-23 are captured
     PCICR |= (1<<PCIE2); //pin change interrupts are enabled
 }
 
-// main processing for this module is not required, but declare the function anyway
-void process_input() {
-    /* do nothing */
+// debounced state of the input port, low level = active switch
+uint8_t input_currentLevels() {
+    return debouncedPort;
 }
\ No newline at end of file
@@ -1,15 +1,58 @@
 /* ------------------------------------- 
 	<input.h>
 	• listen to pin change interrupts on a PIND
+	• debounce all switch lines at once on a system tick
+	• tell short, long and double presses apart
 	• trigger a function when there is a pulse on a switch line
+	• keep a queue of timestamped switch events for the master
 ------------------------------------- */
 
+/* EVENTS */
+#define INPUT_EVENTS_QUEUE_SIZE     16 //power of two
+
+// event info byte: 3 lsb — pin number, then edge flag and press type
+#define INPUT_EVENT_PIN(info)       ((info) & 0x07)
+#define INPUT_EVENT_PRESSED         (1<<3) //falling edge, switch became active
+#define INPUT_EVENT_TYPE(info)      (((info) >> 4) & 0x03)
+
+enum InputPressTypes {
+    Press_Edge = 0x00, //debounced edge, reported right away
+    Press_Short = 0x01, //released before long press timeout, no second press in the double press window
+    Press_Long = 0x02, //held longer than long press timeout
+    Press_Double = 0x03, //second press shortly after a short one, instead of Press_Short
+};
+
+typedef struct {
+    uint8_t info;
+    uint16_t time; //system ticks
+} InputEvent;
+
 /* INTERRUPTS */
 ISR(PCINT2_vect);
 
 /* FUNCTIONS */
 void init_input_ports(); //basic setup
-void process_input(); //process in a loop
+void input_sample(); //call on every system tick
+
+// is debouncer running, pin change interrupt wakes it up otherwise
+bool input_sampling();
+
+// stop and restart listening to switches
+void input_suspend();
+void input_resume();
+
+// current levels on all switch lines
+uint8_t input_currentLevels();
+
+// number of events waiting in the queue
+uint8_t input_eventsCount();
+
+// take the oldest event, returns false if queue is empty
+bool input_popEvent(InputEvent *event);
+
+// were any events dropped since the last call (resets the flag)
+bool input_eventsOverflowed();
 
-// OVERRIDE: this method is called when we detect a pulse on a switch
-void input_trigger(uint8_t number) __attribute__((weak));
+// OVERRIDE: this method is called when we detect a press on a switch,
+// first with Press_Edge and then once again when the press is classified
+void input_trigger(uint8_t number, uint8_t pressType) __attribute__((weak));
@@ -1,5 +1,4 @@
 #include <avr/io.h>
-#include <util/delay.h>
 #include <avr/interrupt.h>
 #include <stdlib.h> 
 #include <stdbool.h> 
@@ -8,26 +7,48 @@
 
 #include "input.h"
 #include "output.h"
+#include "dispatch.h"
+#include "counters.h"
 
 static bool volatile testButtonPressed = false; 
-static uint8_t volatile addressBufferCounter = 0x00;
+static bool volatile interruptLineRaised = false;
+static uint16_t volatile interruptLineOverflows = 0x0000;
+
+// address frame from the previous board
+static bool volatile frameStarted = false;
+static uint8_t volatile frameLastEdge = 0x00; //timer0 value at the last falling edge
+static uint8_t volatile frameBitsReceived = 0x00;
+static uint16_t volatile frameReceived = 0x0000;
+static uint8_t volatile addressQuietOverflows = 0x00; //no edges on address line for that long
+
+// address frame to the next board
+static bool volatile frameSending = false;
+static uint16_t volatile frameToSend = 0x0000; //bits left to send
+static uint8_t volatile frameEdgesLeft = 0x00; //falling edges left to send
+static bool volatile hasPendingIndex = false;
+static uint8_t volatile pendingIndex = 0x00;
 
 // generic timeout timer
 void start_timer0();
 void stop_timer0();
 
+void address_edgeReceived(uint8_t now);
+
 // pin change interrupt on a PORTB, where test button is located
 ISR(PCINT0_vect) { 
+    counters_increment(Counter_PCINT0);
     if ( (PINB & TEST_SWITCH_BUTTON) == 0 ) { //falling edge on a test button
         testButtonPressed = true;
+        dispatch_post(Task_Interface);
     }
 }
 
 // pin change interrupt on an input address line
 ISR(PCINT1_vect) { 
+    counters_increment(Counter_PCINT1);
     if ( (PINC & ADDRESS_LINE_IN) == 0x00 ) { //falling edge
-        start_timer0(); //reset timeout timer 
-        addressBufferCounter++; //count pulses
+        start_timer0();
+        address_edgeReceived(TCNT0);
     }
 }
 
@@ -54,80 +75,174 @@ void init_interface_ports() {
 
 // slowly turn everything on or off, when user presses the test button
 void testModeSequence() {
-    cli(); { //disable interrupts during timed sequence
-        uint8_t currentMask = currentOutputStateMask();
-
-        if ( currentMask == 0x00 ) { //everything is off, switch on from first to last
-            setOutputStateMaskSlowly(0xFF);
-        } else { //switch off in sequence
-            setOutputStateMaskSlowly(0x00);
-        }
+    OutputMask currentMask = currentOutputStateMask();
 
-    }; sei(); //enable interrupts again
+    if ( currentMask == 0x00 ) { //everything is off, switch on from first to last
+        setOutputStateMaskSlowly(OUTPUT_ALL);
+    } else { //switch off in sequence
+        setOutputStateMaskSlowly(0x00);
+    }
 }
 
 /* ----------  timer0 ----------- */
 
+// timer0 runs free while there is something to time, 8us per tick
+#define TIMER0_PRESCALER            64
+#define TIMER0_OVERFLOWS_PER_SECOND (F_CPU/TIMER0_PRESCALER/256)
+
+// address frame timing in timer0 ticks, the longest interval is shorter than one overflow;
+// bits are split at 3.5 units, an edge may come 1.5 units (96us) late for interrupts on either board
+#define ADDRESS_UNIT_TICKS          (ADDRESS_PULSE_US*(F_CPU/1000000)/TIMER0_PRESCALER)
+#define ADDRESS_ZERO_TICKS          (ADDRESS_UNIT_TICKS*2)
+#define ADDRESS_ONE_TICKS           (ADDRESS_UNIT_TICKS*5)
+#define ADDRESS_GAP_TICKS           (ADDRESS_UNIT_TICKS*8) //longer interval starts a new frame
+#define ADDRESS_QUIET_OVERFLOWS     2 //~4ms without edges drops an unfinished frame
+
 static bool volatile timer0_active = false;
 
 void start_timer0() {
     if ( timer0_active == false ) { //if timer was off, reset all settings
         TCCR0A = 0x00; //normal mode
-        TCCR0B = _BV(WGM12) | _BV(CS00) | _BV(CS02); //the slowest 1024 prescaler
+        TCCR0B = _BV(CS00) | _BV(CS01); //64 prescaler
+        TCNT0 = 0x00;
 
         timer0_active = true;
 
-        TIMSK0 = _BV(TOIE0); //overflow interrupt enabled
-        TIFR0 &= ~_BV(TOV0); //reset flag
-    } else {
-        TCNT0 = 0x00; //reset the timer counter if it was running already
+        TIFR0 = _BV(TOV0); //reset flag
+        TIMSK0 |= _BV(TOIE0); //overflow interrupt enabled
     }
 }
 
 void stop_timer0() {
     TCCR0B &= ~(_BV(CS00) | _BV(CS01) | _BV(CS02) ); //stop timer
+    TIMSK0 = 0x00;
     TCNT0 = 0x00; //reset counter to zero
 
     timer0_active = false;
 }
 
-void timer0_one_second_elapsed() {
-    stop_timer0();   
-    iface_controlInterruptLine(false);   //release interrupt line, in case master is not instered in us
+// position and its crc-4, inverted, so a frame of zero intervals only is never valid
+static uint16_t address_encode(uint8_t index) {
+    uint8_t crc = 0x00;
+    for ( uint8_t bit=0; bit<8; bit++ ) { //in the order bits are sent
+        bool feedback = ((crc >> 3) ^ (index >> bit)) & 0x01;
+        crc = (crc << 1) & 0x0F;
+        if ( feedback ) {
+            crc ^= 0x03; //x+1, x^4 is shifted out
+        }
+    }
+
+    return index | ((uint16_t)(crc ^ 0x0F) << 8);
 }
 
-void timer0_each_overflow() {
-    //no more pulses are coming on an address line
-    if ( addressBufferCounter > 0 ) {
+static bool address_valid(uint16_t frame) {
+    return (address_encode(frame & 0xFF) == frame);
+}
 
-        if ( addressBufferCounter % 2 == 0 ) { //there are always a double amount of pulses (just in case)
-            uint8_t address = addressBufferCounter/2;
+// first pulse of the frame, the rest is done by compare interrupt
+static void address_startFrame(uint8_t index) {
+    start_timer0();
 
-            if ( iface_receivedAddressNumber ) {
-                iface_receivedAddressNumber(address); //give i2c address to main.c
-            }
+    frameToSend = address_encode(index);
+    frameEdgesLeft = ADDRESS_FRAME_BITS+1;
+    frameSending = true;
 
-            for ( uint8_t i=0; i<addressBufferCounter+2; i++ ) { //pulse new address to the next device
-                PORTC |= ADDRESS_LINE_OUT;
-                _delay_ms(1);
-                PORTC &= ~ADDRESS_LINE_OUT;
-                _delay_ms(1);            
-            }
-        }
+    PORTC |= ADDRESS_LINE_OUT;
+    OCR0B = TCNT0 + ADDRESS_UNIT_TICKS;
+    TIFR0 = _BV(OCF0B); //reset flag
+    TIMSK0 |= _BV(OCIE0B);
+}
+
+void iface_sendChainIndex(uint8_t index) {
+    uint8_t sreg = SREG; //called from interrupts too
+    cli();
+
+    if ( frameSending ) {
+        pendingIndex = index; //the newest position goes out after the current frame
+        hasPendingIndex = true;
+    } else {
+        address_startFrame(index);
+    }
+
+    SREG = sreg;
+}
+
+// called from pin change interrupt, bits are told apart by the time between falling edges
+void address_edgeReceived(uint8_t now) {
+    uint8_t interval = now - frameLastEdge;
+    frameLastEdge = now;
+    addressQuietOverflows = 0;
+
+    if ( !frameStarted || interval > ADDRESS_GAP_TICKS ) {
+        frameStarted = true; //this edge starts a new frame
+        frameBitsReceived = 0;
+        frameReceived = 0x0000;
+        return;
+    }
 
-        addressBufferCounter = 0;
+    if ( interval > (ADDRESS_ZERO_TICKS+ADDRESS_ONE_TICKS)/2 ) {
+        frameReceived |= (1 << frameBitsReceived);
+    }
+
+    if ( ++frameBitsReceived < ADDRESS_FRAME_BITS ) {
+        return;
+    }
+    frameStarted = false;
+
+    if ( !address_valid(frameReceived) ) {
+        return; //noise on the line, wait for the next frame
+    }
+
+    //give chain position to main.c, the next board is one further if the chain has room for it
+    uint8_t index = frameReceived & 0xFF;
+    if ( iface_receivedAddressNumber && iface_receivedAddressNumber(index) ) {
+        iface_sendChainIndex(index+1);
     }
 }
 
-// timer 0 overflow event
+// timer 0 overflow event, every 2ms
 ISR(TIMER0_OVF_vect) {
-    static uint8_t counter = 0;
+    counters_increment(Counter_TIMER0_OVF);
 
-    timer0_each_overflow(); // fastest timeout, 30hz
+    //no more edges are coming on an address line
+    if ( frameStarted && ++addressQuietOverflows >= ADDRESS_QUIET_OVERFLOWS ) {
+        frameStarted = false;
+    }
+
+    //release interrupt line, in case master is not instered in us
+    if ( interruptLineRaised && ++interruptLineOverflows >= TIMER0_OVERFLOWS_PER_SECOND ) {
+        iface_controlInterruptLine(false);
+    }
 
-    if ( ++counter >= F_CPU/1024/256 ) { //each second
-        timer0_one_second_elapsed();
-        counter = 0;
+    if ( !frameStarted && !frameSending && !interruptLineRaised ) {
+        stop_timer0(); //nothing left to time
+    }
+}
+
+// timer 0 compare event, one edge of an address frame
+ISR(TIMER0_COMPB_vect) {
+    counters_increment(Counter_TIMER0_COMPB);
+
+    if ( (PORTC & ADDRESS_LINE_OUT) == 0 ) {
+        PORTC |= ADDRESS_LINE_OUT; //next pulse
+        OCR0B += ADDRESS_UNIT_TICKS;
+        return;
+    }
+
+    PORTC &= ~ADDRESS_LINE_OUT; //falling edge, the next board measures time between them
+
+    if ( --frameEdgesLeft > 0 ) {
+        uint8_t interval = (frameToSend & 0x01) ? ADDRESS_ONE_TICKS : ADDRESS_ZERO_TICKS;
+        frameToSend >>= 1;
+        OCR0B += interval - ADDRESS_UNIT_TICKS; //low until the next pulse
+    } else if ( hasPendingIndex ) {
+        hasPendingIndex = false;
+        OCR0B += ADDRESS_GAP_TICKS; //next board has to see a gap before the new frame
+        frameToSend = address_encode(pendingIndex);
+        frameEdgesLeft = ADDRESS_FRAME_BITS+1;
+    } else {
+        TIMSK0 &= ~_BV(OCIE0B); //frame is over
+        frameSending = false;
     }
 }
 
@@ -143,13 +258,27 @@ void process_interface() {
     }
 }
 
+// timer0 is running, it stops in power down
+bool iface_busy() {
+    return timer0_active;
+}
+
 // external method to control intrerrupt line
 void iface_controlInterruptLine(bool flag) {
+    uint8_t sreg = SREG; //timer0 registers are shared with interrupts
+    cli();
+
     if ( flag ) {
         PORTC |= (INTERRUPT_LINE);
-        start_timer0(); //start timeout timer to release interrupt line automaticaly after 1 second
+
+        interruptLineOverflows = 0; //release interrupt line automaticaly after 1 second
+        interruptLineRaised = true;
+        start_timer0();
     } else {
         PORTC &= ~(INTERRUPT_LINE);
+        interruptLineRaised = false;
     }
+
+    SREG = sreg;
 }
 
@@ -1,7 +1,8 @@
 /* ------------------------------------- 
 	<interface.h>
 	• test button
-	• auto-addressing for i2c
+	• auto-addressing for i2c: chain position comes from the previous board as a timed frame
+	• position is passed to the next board right away and repeated every 5 seconds
 	• interrupt line
 ------------------------------------- */
 
@@ -12,18 +13,33 @@
 #define ADDRESS_LINE_IN    (1<<PC3)
 #define ADDRESS_LINE_OUT    (1<<PC1)
 
+/* ADDRESS CHAIN */
+// frame: 13 falling edges on the address line, 12 intervals between them are bits —
+// chain position and its inverted crc-4 (x^4+x+1), lsb first, short interval (2 units) is 0,
+// long (5 units) is 1, every pulse is high for 1 unit, the whole frame takes less than 4ms;
+// any two wrong bits are caught, a late edge makes two of them
+#define ADDRESS_PULSE_US    64 //one unit, multiple of 8us
+#define ADDRESS_FRAME_BITS  12
+
 /* INTERRUPTS */
 ISR(PCINT0_vect);
 ISR(PCINT1_vect);
 
 ISR(TIMER0_OVF_vect);
+ISR(TIMER0_COMPB_vect);
 
 /* FUNCTIONS */
 void init_interface_ports(); //basic setup
 void process_interface(); //loop processing
 
+// is there an address or interrupt line timeout running
+bool iface_busy();
+
 // control interrupt line
 void iface_controlInterruptLine(bool flag);
 
-// OVERRIDE: receive new address for i2c
-void iface_receivedAddressNumber(uint8_t address) __attribute__((weak)); //override
\ No newline at end of file
+// send chain position to the next board, waits for a frame which is going out already
+void iface_sendChainIndex(uint8_t index);
+
+// OVERRIDE: chain position from the previous board, returns true if the next one gets index+1
+bool iface_receivedAddressNumber(uint8_t index) __attribute__((weak)); //override
\ No newline at end of file
@@ -1,5 +1,4 @@
 #include <avr/io.h>
-#include <util/delay.h>
 #include <avr/interrupt.h>
 #include <stdlib.h> 
 #include <stdbool.h> 
@@ -11,9 +10,21 @@
 #include "output.h"
 #include "i2c.h"
 #include "interface.h"
+#include "systick.h"
+#include "storage.h"
+#include "dispatch.h"
+#include "counters.h"
+#include "commands.h"
+#include "scenes.h"
+#include "rules.h"
+#include "timers.h"
 
 #define DEVICE_CLASS  0x0E
 
+//chain positions 0-7 keep the class addresses, the next ones go to a range below
+#define CHAIN_EXTENDED_FIRST    0x10
+#define CHAIN_LENGTH_MAX        (8 + 0x70-CHAIN_EXTENDED_FIRST) //0x70-0x77 and 0x10-0x6F
+
 #define POWER_SWITCHES    (1<<PB6)
 #define POWER_RELAYS    (1<<PB7)
 
@@ -28,25 +39,46 @@
 #endif
 
 #define REMOTE_COMMAND_LED (1<<PC2)
+#define REMOTE_COMMAND_LED_MS 50 //blink length
+
+#define TICKS_MS(ms) ((ms)/(1000/SYSTICK_HZ))
 
-uint8_t storedOutputValues[8] EEMEM = { 0x00 };
+uint8_t storedOutputValues[8] EEMEM = { 0x00 }; //old format, read only if the journal is empty
 volatile bool outputStateNeedsToBeSaved = false;
 
 uint8_t i2c_address_num EEMEM = (DEVICE_CLASS<<3);
+uint8_t i2c_chain_index EEMEM = 0xFF; //position from a received frame, 0xFF until the board was enumerated
+uint8_t i2c_group_ids[I2C_GROUPS_COUNT] EEMEM = { I2C_GROUP_NONE };
+volatile bool groupsNeedToBeSaved = false;
+
+// all EEMEM blocks: settings above, output journal, scenes, local rules and auto-off lengths
+#define EEPROM_USED (8 + 1 + 1 + I2C_GROUPS_COUNT \
+    + JOURNAL_RECORDS*JOURNAL_RECORD_SIZE \
+    + SCENES_COUNT*SCENE_RECORD_SIZE \
+    + RULES_COUNT*RULE_RECORD_SIZE \
+    + OUTPUT_COUNT)
+#if EEPROM_USED > E2END+1
+    #error "EEPROM blocks don't fit into the EEPROM of the chip"
+#endif
 
-enum RemoteCommands {
-    //set commands
-    Command_SetPortValue = 's',  //lsb 4 bits — port number, msb 4 bits — 0x1111 = on, 0x0000 = off
-    Command_SetAllPortBits = 'S', //use bit mask to toggle all ports
-    Command_TogglePortValue = 't', 
-    Command_AllSwitchOff = 'f',
-    Command_AllSwitchOn = 'n',
-
-    //get commands
-    Command_GetPortValue = 'g',  //return port by number
-    Command_GetAllPortBits = 'G'  //return ports bit mask
+//register block, master reads it directly after Command_SelectRegister
+enum Registers {
+    Register_OutputMask = 0x00, //relays bit mask
+    Register_InputLevels = 0x01, //raw levels on switch lines
+    Register_InputEvents = 0x02, //switch presses counter, wraps around
+    Register_CommandsLow = 0x03, //executed write commands counter, 16 bit
+    Register_CommandsHigh = 0x04,
+    Register_PendingEvents = 0x05, //switch events waiting in the queue
+    Register_QueueSize = 0x06, //write commands the board takes in one go, size bursts by that
+    Register_QueueHighWater = 0x07, //the most write commands waiting at once
+    Register_RejectedFrames = 0x08, //frames refused because the queue was full, wraps around
+    Register_ChainIndex = 0x09, //position in the address chain, 0xFF if unknown
 };
 
+volatile uint8_t inputEventsCounter = 0x00;
+uint16_t commandsCounter = 0x0000;
+volatile uint8_t commandLedTicks = 0x00; //blue led goes off when it reaches zero
+
 void init_ports() {
     //default values
     PCMSK0 = 0x00; PCMSK1 = 0x00; PCMSK2 = 0x00;
@@ -75,132 +107,704 @@ void init_ports() {
     PORTC &= ~(INTERRUPT_LINE); 
 }
 
-void input_trigger(uint8_t number) {
-    uint8_t currentMask = currentOutputStateMask();
-    currentMask ^= _BV(number); //toggle by default
-    setOutputStateMask(currentMask);
-    outputStateNeedsToBeSaved = true; //schedule eeprom save
-
-    iface_controlInterruptLine(true); //trigger interrupt line to report to the master
+//outputs a scene switches right away, sequenced channels keep their state for now
+static OutputMask scene_immediateMask(OutputMask mask, OutputMask sequenced) {
+    return (mask & ~sequenced) | (currentOutputStateMask() & sequenced);
 }
 
-//i2c write commands
-void i2c_executeWriteCommand(char command, uint8_t data) {
-    uint8_t mask = currentOutputStateMask();
-
-    switch (command) {
-        case Command_SetPortValue: {
-            //lsb 4 bits — port number
-            //msb 4 bits — 0x1111 = on, 0x0000 = off
-            uint8_t port = (data & 0x0F);
-            uint8_t value = ((data & 0xF0)>>4);
+//apply a local rule, called from the tick interrupt, returns true if outputs were changed
+static bool rule_apply(const Rule *rule) {
+    OutputMask mask = currentOutputStateMask();
+    OutputMask sequenced, immediate;
 
-            if ( value != 0x00 ) {
-                mask |= _BV(port-1);
-            } else {
-                mask &= ~_BV(port-1);
-            }
-            break;
-        }
-        case Command_TogglePortValue:
-            mask ^= (1<<(data-1)); //toggle on bit
+    switch ( rule->action ) {
+        case Rule_Toggle:
+            mask ^= rule->outputs;
             break;
-        case Command_SetAllPortBits:
-            mask = data;
+        case Rule_On:
+            mask |= rule->outputs;
             break;
-        case Command_AllSwitchOn:
-            mask = 0xFF;
-            break;
-        case Command_AllSwitchOff:
-            mask = 0x00;
+        case Rule_Off:
+            mask &= ~rule->outputs;
             break;
+        case Rule_Pulse:
+            if ( !timers_validPulse(rule->argument) ) {
+                return false; //no length, nothing to do
+            }
+            setOutputStateMask(mask | rule->outputs);
+            timers_start(rule->outputs, rule->argument); //outputs are on already
+            return true;
+        case Rule_Scene:
+            if ( !scenes_get(rule->argument, &mask, &sequenced) ) {
+                return false; //empty slot
+            }
+            immediate = scene_immediateMask(mask, sequenced);
+            setOutputStateMask(immediate);
+            if ( immediate != mask ) {
+                setOutputStateMaskSlowly(mask); //sequenced channels follow
+            }
+            return true;
         default:
-            break;
+            return false;
+    }
+
+    setOutputStateMask(mask);
+    return true;
+}
+
+void input_trigger(uint8_t number, uint8_t pressType) {
+    Rule rule;
+    rules_get(RULE_INDEX(number, pressType), &rule); //plain table lookup, we are inside the tick interrupt
+
+    if ( rule.action == Rule_Default ) {
+        rule.action = (pressType == Press_Edge) ? Rule_Toggle : Rule_None; //input N toggles relay N
+        rule.outputs = OUTPUT_BIT(number);
+    }
+
+    bool changed = rule_apply(&rule);
+    if ( changed ) {
+        outputStateNeedsToBeSaved = true; //schedule eeprom save
+    }
+
+    if ( pressType == Press_Edge ) {
+        i2c_setRegister(Register_InputEvents, ++inputEventsCounter);
+    } else if ( !changed ) {
+        return; //classified presses are only reported to the master through events queue
+    }
+
+    iface_controlInterruptLine(true); //trigger interrupt line to report to the master
+}
+
+/* ------------- i2c write commands, see commands.h ------------ */
+
+//two-phase switching: while staging, write commands build a mask without touching relays,
+//'C' applies it, so boards committed by one general call switch together
+static bool stagingMode = false;
+static bool hasStagedMask = false;
+static OutputMask stagedMask = 0x00;
+
+//mask the next write command starts from
+static OutputMask command_baseMask() {
+    return (stagingMode && hasStagedMask) ? stagedMask : currentOutputStateMask();
+}
+
+//every write command ends here
+void write_command_done(OutputMask mask) {
+    commandsCounter++;
+
+    if ( stagingMode ) {
+        stagedMask = mask; //relays wait for the commit
+        hasStagedMask = true;
+        return;
     }
 
     setOutputStateMask(mask);
     outputStateNeedsToBeSaved = true;
 
     PORTC |= REMOTE_COMMAND_LED; //blink blue led
+    commandLedTicks = TICKS_MS(REMOTE_COMMAND_LED_MS);
 }
 
-//i2c read commands
-void i2c_executeReadCommand(char command, uint8_t argument, volatile uint8_t *outputData) {
-    uint8_t mask = currentOutputStateMask();
+//lsb 4 bits — port number, msb 4 bits — 0x1111 = on, 0x0000 = off
+void command_SetPortValue(uint8_t argument) {
+    OutputMask mask = command_baseMask();
+    uint8_t port = (argument & 0x0F);
+    uint8_t value = ((argument & 0xF0)>>4);
 
-    switch (command) {
-        case Command_GetPortValue:
-            if ( (mask & _BV(argument)) != 0 ) {
-                *outputData = 0xFF;
-            } else {
-                *outputData = 0x00;
-            }
+    if ( value != 0x00 ) {
+        mask |= OUTPUT_BIT(port-1);
+    } else {
+        mask &= ~OUTPUT_BIT(port-1);
+    }
+    write_command_done(mask);
+}
+
+//mask byte for the next 'S', wider masks are sent as several 'S' pairs, lsb byte first
+static uint8_t maskBytePointer = 0x00;
+
+//'S' without 'B' before it in the same transaction starts from the first byte
+void i2c_transactionStarted() {
+    maskBytePointer = 0x00;
+}
+
+void command_SelectMaskByte(uint8_t argument) {
+    maskBytePointer = argument;
+}
+
+//replace one byte of the mask and move to the next one, wraps around after the last byte
+void command_SetAllPortBits(uint8_t argument) {
+    uint8_t shift = maskBytePointer*8;
+    OutputMask mask = command_baseMask() & ~((OutputMask)0xFF << shift);
+    mask |= (OutputMask)argument << shift;
+
+    maskBytePointer = (maskBytePointer+1) % OUTPUT_BYTES;
+    write_command_done(mask);
+}
+
+void command_TogglePortValue(uint8_t argument) {
+    write_command_done(command_baseMask() ^ OUTPUT_BIT(argument-1)); //toggle on bit
+}
+
+void command_SwitchPortOn(uint8_t argument) {
+    write_command_done(command_baseMask() | OUTPUT_BIT(argument-1));
+}
+
+void command_SwitchPortOff(uint8_t argument) {
+    write_command_done(command_baseMask() & ~OUTPUT_BIT(argument-1));
+}
+
+void command_AllSwitchOff(uint8_t argument) {
+    write_command_done(0x00);
+}
+
+void command_AllSwitchOn(uint8_t argument) {
+    write_command_done(OUTPUT_ALL);
+}
+
+//1 — following write commands are staged, 0 — back to switching right away, staged mask is kept
+void command_StageCommands(uint8_t argument) {
+    stagingMode = (argument != 0x00);
+}
+
+//0 — apply the staged mask, 1 — drop it, staging is over in both cases
+void command_CommitStaged(uint8_t argument) {
+    bool apply = hasStagedMask && argument == 0x00;
+
+    stagingMode = false;
+    hasStagedMask = false;
+
+    if ( apply ) {
+        write_command_done(stagedMask);
+    }
+}
+
+//length for the next 'p' and 'U', see TIMER_LENGTH()
+static uint8_t timerLength = 0x00;
+
+void command_SelectTimerLength(uint8_t argument) {
+    timerLength = argument;
+}
+
+//on now and off after the selected length, while staging only the on state is staged
+void command_PulsePort(uint8_t argument) {
+    if ( !timers_validPulse(timerLength) ) {
+        uint8_t sreg = SREG;
+        cli();
+        counters_increment(Counter_InvalidCommands); //select a length with 'D' first
+        SREG = sreg;
+        return;
+    }
+
+    write_command_done(command_baseMask() | OUTPUT_BIT(argument-1));
+
+    if ( !stagingMode ) {
+        timers_start(OUTPUT_BIT(argument-1), timerLength);
+    }
+}
+
+//channel goes off by itself after the selected length every time it is switched on, zero length disables it
+void command_SetAutoOff(uint8_t argument) {
+    timers_setAutoOff(argument-1, timerLength);
+    dispatch_post(Task_Housekeeping);
+}
+
+//channels the next stored scene switches in sequence, the rest switches at once
+static OutputMask sceneSequencedMask = 0x00;
+
+//0 — clear, otherwise the channel number to switch in sequence
+void command_SceneSequenced(uint8_t argument) {
+    if ( argument == 0x00 ) {
+        sceneSequencedMask = 0x00;
+    } else {
+        sceneSequencedMask |= OUTPUT_BIT(argument-1);
+    }
+}
+
+//current (or staged) outputs become a scene, eeprom is written by housekeeping
+void command_StoreScene(uint8_t argument) {
+    scenes_store(argument, command_baseMask(), sceneSequencedMask);
+    sceneSequencedMask = 0x00; //every scene starts with a clean set
+    dispatch_post(Task_Housekeeping);
+}
+
+//scene comes from the ram cache, sequenced channels follow one by one
+void command_RecallScene(uint8_t argument) {
+    OutputMask mask, sequenced;
+    if ( !scenes_get(argument, &mask, &sequenced) ) {
+        uint8_t sreg = SREG;
+        cli();
+        counters_increment(Counter_InvalidCommands); //nothing stored there
+        SREG = sreg;
+        return;
+    }
+
+    if ( stagingMode ) {
+        write_command_done(mask); //commit switches everything at once
+        return;
+    }
+
+    OutputMask immediate = scene_immediateMask(mask, sequenced);
+    write_command_done(immediate);
+
+    if ( immediate != mask ) {
+        setOutputStateMaskSlowly(mask);
+    }
+}
+
+//rule being edited: 'R' loads it, 'M' and 'V' change it, 'A' stores it
+static Rule ruleBuffer;
+static uint8_t ruleIndex = 0x00;
+static uint8_t ruleBytePointer = 0x00;
+
+void command_SelectRule(uint8_t argument) {
+    ruleIndex = argument;
+    ruleBytePointer = 0x00;
+    rules_get(ruleIndex, &ruleBuffer);
+}
+
+//next byte of the rule outputs, lsb byte first, wraps around after the last byte
+void command_RuleOutputsByte(uint8_t argument) {
+    uint8_t shift = ruleBytePointer*8;
+    ruleBuffer.outputs &= ~((OutputMask)0xFF << shift);
+    ruleBuffer.outputs |= (OutputMask)argument << shift;
+
+    ruleBytePointer = (ruleBytePointer+1) % OUTPUT_BYTES;
+}
+
+void command_RuleArgument(uint8_t argument) {
+    ruleBuffer.argument = argument;
+}
+
+//the last command of a rule, switches use it right away, eeprom is written by housekeeping
+void command_RuleAction(uint8_t argument) {
+    ruleBuffer.action = argument;
+    rules_set(ruleIndex, &ruleBuffer);
+    dispatch_post(Task_Housekeeping);
+}
+
+//group membership is kept in a free slot, saved to eeprom by housekeeping
+void command_JoinGroup(uint8_t argument) {
+    uint8_t freeSlot = I2C_GROUPS_COUNT;
+
+    for ( uint8_t i=0; i<I2C_GROUPS_COUNT; i++ ) {
+        uint8_t group = i2c_group(i);
+        if ( group == argument ) {
+            return; //already a member
+        } else if ( group == I2C_GROUP_NONE && freeSlot == I2C_GROUPS_COUNT ) {
+            freeSlot = i;
+        }
+    }
+
+    if ( freeSlot == I2C_GROUPS_COUNT ) {
+        uint8_t sreg = SREG;
+        cli();
+        counters_increment(Counter_InvalidCommands); //no room, leave some group first
+        SREG = sreg;
+        return;
+    }
+
+    i2c_setGroup(freeSlot, argument);
+    groupsNeedToBeSaved = true;
+    dispatch_post(Task_Housekeeping);
+}
+
+//I2C_GROUP_ALL leaves every group
+void command_LeaveGroup(uint8_t argument) {
+    for ( uint8_t i=0; i<I2C_GROUPS_COUNT; i++ ) {
+        if ( argument == I2C_GROUP_ALL || i2c_group(i) == argument ) {
+            i2c_setGroup(i, I2C_GROUP_NONE);
+        }
+    }
+
+    groupsNeedToBeSaved = true;
+    dispatch_post(Task_Housekeeping);
+}
+
+/* ------------- i2c read commands, answered from TWI interrupt ------------ */
+
+//switch events answer: header byte (number of events in this answer, msb — some events were lost),
+//then 3 bytes for every event (info, timestamp lsb, timestamp msb)
+bool events_readByte(uint8_t index, volatile uint8_t *outputData) {
+    static uint8_t eventsToSend = 0;
+    static InputEvent event;
+
+    if ( index == 0 ) {
+        eventsToSend = input_eventsCount(); //never send more than announced
+        *outputData = eventsToSend | (input_eventsOverflowed() ? 0x80 : 0x00);
+        return (eventsToSend > 0);
+    }
+
+    switch ( (index-1) % 3 ) {
+        case 0:
+            input_popEvent(&event); //event leaves the queue when its first byte is sent
+            *outputData = event.info;
             break;
-        case Command_GetAllPortBits:
-            *outputData = mask;
+        case 1:
+            *outputData = event.time & 0xFF;
             break;
-        default: 
-            *outputData = 0x00;
+        default:
+            *outputData = event.time >> 8;
             break;
     }
 
-    //master received our new state, release the interrupt line
-    iface_controlInterruptLine(false);    
+    return (index < eventsToSend*3);
 }
 
-void iface_receivedAddressNumber(uint8_t address) {
-    //lsb 3 bits — device number
-    //next 4 bits — device class
-    uint8_t classPart = (DEVICE_CLASS&0xF) << 3;
-    uint8_t addressPart = address & 0x7;
-    uint8_t newAddress = (classPart | addressPart);
+//counters answer: 2 bytes for every counter (lsb first), from the requested one to the last
+bool counters_readByte(uint8_t first, uint8_t index, volatile uint8_t *outputData) {
+    static uint16_t snapshot[COUNTERS_COUNT];
 
-    //restart i2c with a new address
-    init_i2c(newAddress);
+    if ( index == 0 ) {
+        for ( uint8_t i=0; i<COUNTERS_COUNT; i++ ) {
+            snapshot[i] = counters[i]; //no other interrupt can change them during the copy
+        }
+    }
+
+    uint8_t counter = first + index/2;
+    if ( counter >= COUNTERS_COUNT ) {
+        *outputData = 0x00;
+        return false;
+    }
+
+    if ( index & 0x01 ) {
+        *outputData = snapshot[counter] >> 8;
+        return (counter+1 < COUNTERS_COUNT);
+    }
+
+    *outputData = snapshot[counter] & 0xFF;
+    return true;
+}
+
+//scenes answer: for every slot from the requested one to the last —
+//valid flag (0x01 or 0x00), mask bytes, sequenced channels bytes (both lsb first)
+bool scenes_readByte(uint8_t first, uint8_t index, volatile uint8_t *outputData) {
+    static OutputMask mask, sequenced;
+    static bool valid;
+
+    uint8_t slot = first + index/SCENE_RECORD_SIZE;
+    uint8_t position = index % SCENE_RECORD_SIZE;
+
+    if ( slot >= SCENES_COUNT ) {
+        *outputData = 0x00;
+        return false;
+    }
+
+    if ( position == 0 ) {
+        valid = scenes_get(slot, &mask, &sequenced);
+        *outputData = valid ? 0x01 : 0x00;
+    } else if ( position <= OUTPUT_BYTES ) {
+        *outputData = OUTPUT_BYTE(mask, position-1);
+    } else {
+        *outputData = OUTPUT_BYTE(sequenced, position-1-OUTPUT_BYTES);
+    }
+
+    return (slot+1 < SCENES_COUNT || position+1 < SCENE_RECORD_SIZE);
+}
+
+bool command_GetScenes(uint8_t argument, uint8_t index, volatile uint8_t *outputData) {
+    return scenes_readByte(argument, index, outputData);
+}
+
+//rules answer: action, argument and outputs bytes (lsb first) for every rule from the requested one to the last
+bool command_GetRules(uint8_t argument, uint8_t index, volatile uint8_t *outputData) {
+    static Rule rule;
 
-    //store that address in eeprom
-    eeprom_write_byte((uint8_t *)&i2c_address_num, newAddress);
+    uint8_t number = argument + index/RULE_RECORD_SIZE;
+    uint8_t position = index % RULE_RECORD_SIZE;
+
+    if ( number >= RULES_COUNT ) {
+        *outputData = 0x00;
+        return false;
+    }
+
+    if ( position == 0 ) {
+        rules_get(number, &rule);
+        *outputData = rule.action;
+    } else if ( position == 1 ) {
+        *outputData = rule.argument;
+    } else {
+        *outputData = OUTPUT_BYTE(rule.outputs, position-2);
+    }
+
+    return (number+1 < RULES_COUNT || position+1 < RULE_RECORD_SIZE);
+}
+
+//timers answer: 2 bytes for every channel (lsb first), time left in TIMERS_TICK_MS, zero if not counting
+bool command_GetTimers(uint8_t argument, uint8_t index, volatile uint8_t *outputData) {
+    uint8_t channel = argument + index/2;
+    if ( channel >= OUTPUT_COUNT ) {
+        *outputData = 0x00;
+        return false;
+    }
+
+    uint16_t steps = timers_remaining(channel); //one counter can't change between its two bytes, we are in the interrupt
+    if ( index & 0x01 ) {
+        *outputData = steps >> 8;
+        return (channel+1 < OUTPUT_COUNT);
+    }
+
+    *outputData = steps & 0xFF;
+    return true;
+}
+
+//membership slots, I2C_GROUP_NONE for free ones
+bool command_GetGroups(uint8_t argument, uint8_t index, volatile uint8_t *outputData) {
+    *outputData = i2c_group(index);
+    return (index+1 < I2C_GROUPS_COUNT);
+}
+
+//master has read our new state, release the interrupt line
+bool command_GetPortValue(uint8_t argument, uint8_t index, volatile uint8_t *outputData) {
+    *outputData = ( (currentOutputStateMask() & OUTPUT_BIT(argument)) != 0 ) ? 0xFF : 0x00;
+
+    iface_controlInterruptLine(false);
+    return false;
+}
+
+//mask bytes from the requested one to the last, lsb byte first
+bool command_GetAllPortBits(uint8_t argument, uint8_t index, volatile uint8_t *outputData) {
+    static OutputMask snapshot = 0x00;
+
+    if ( index == 0 ) {
+        snapshot = currentOutputStateMask(); //all bytes of one answer are from the same state
+    }
+
+    uint8_t byte = argument + index;
+    *outputData = (byte < OUTPUT_BYTES) ? OUTPUT_BYTE(snapshot, byte) : 0x00;
+
+    iface_controlInterruptLine(false);
+    return (byte+1 < OUTPUT_BYTES);
+}
+
+bool command_GetEvents(uint8_t argument, uint8_t index, volatile uint8_t *outputData) {
+    iface_controlInterruptLine(false);
+    return events_readByte(index, outputData);
+}
+
+bool command_GetCounters(uint8_t argument, uint8_t index, volatile uint8_t *outputData) {
+    iface_controlInterruptLine(false);
+    return counters_readByte(argument, index, outputData);
+}
+
+/* ------------- address chain, see interface.h ------------ */
+
+static volatile uint8_t chainIndex = 0xFF; //unknown until the first frame, or the one stored after it
+volatile bool addressNeedsToBeSaved = false;
+
+//first 8 boards: lsb 3 bits - device number, next 4 bits - device class
+uint8_t chain_address(uint8_t index) {
+    if ( index < 8 ) {
+        return ((DEVICE_CLASS&0xF) << 3) | index;
+    }
+    return CHAIN_EXTENDED_FIRST + (index-8);
+}
+
+//called from pin change interrupt, previous board repeats the frame every 5 seconds
+bool iface_receivedAddressNumber(uint8_t index) {
+    if ( index >= CHAIN_LENGTH_MAX ) {
+        counters_increment(Counter_ChainOverflows); //out of the address space, keep the old address
+        return false;
+    }
+
+    if ( index != chainIndex ) {
+        chainIndex = index;
+
+        //restart i2c with a new address, eeprom is written by housekeeping
+        init_i2c(chain_address(index));
+        addressNeedsToBeSaved = true;
+        dispatch_post(Task_Housekeeping);
+        dispatch_post(Task_Registers);
+
+        iface_controlInterruptLine(true); //a board has a new address, master can look for it
+    }
+
+    return (index+1 < CHAIN_LENGTH_MAX); //the last position has nobody to pass on to
+}
+
+//keep the next board in place, a hot-plugged one gets its address this way
+void chain_repeat() {
+    if ( chainIndex != 0xFF && chainIndex+1 < CHAIN_LENGTH_MAX ) { //a board that was never enumerated keeps quiet
+        iface_sendChainIndex(chainIndex+1);
+    }
+}
+
+//power lines are switched on system tick, so the bus stays serviced
+enum PowerStates {
+    Power_Ready = 0x00,
+    Power_Off, //everything is off after reset
+    Power_SwitchesOn, //12v for switches
+    Power_RelaysOn, //5v for relays
+    Power_SwitchesOff, //touch switches recalibration
+    Power_SwitchesSettle, //switches are back, wait before listening to them
+};
+
+static volatile uint8_t powerState = Power_Ready;
+static volatile uint8_t powerTicks = 0x00;
+static OutputMask restoredOutputMask = 0x00;
+static uint16_t powerUpCommands = 0x0000; //commandsCounter when the power sequence began
+
+static void power_enter(uint8_t state, uint8_t ticks) {
+    powerTicks = ticks;
+    powerState = state;
+}
+
+void power_tick() {
+    if ( powerState == Power_Ready || --powerTicks > 0 ) {
+        return;
+    }
+
+    switch ( powerState ) {
+        case Power_Off:
+            PORTB |= POWER_SWITCHES;
+            power_enter(Power_SwitchesOn, TICKS_MS(50));
+            break;
+        case Power_SwitchesOn:
+            PORTB |= POWER_RELAYS;
+            power_enter(Power_RelaysOn, TICKS_MS(50));
+            break;
+        case Power_RelaysOn:
+            input_resume();
+            if ( commandsCounter == powerUpCommands ) { //master has not written outputs in the meantime
+                setOutputStateMaskSlowly(restoredOutputMask); //relays have power now
+            }
+            power_enter(Power_Ready, 0);
+            break;
+        case Power_SwitchesOff:
+            PORTB |= POWER_SWITCHES;
+            power_enter(Power_SwitchesSettle, TICKS_MS(100));
+            break;
+        default:
+            input_resume();
+            power_enter(Power_Ready, 0);
+            break;
+    }
 }
 
 //slowly turn power to switches and relays
 void delayed_power_sequence() {
-    cli(); {
-        _delay_ms(10);
+    input_suspend(); //switch lines are floating without power
 
-        PORTB &= ~POWER_SWITCHES;
-        PORTB &= ~POWER_RELAYS;
-        _delay_ms(50);
+    PORTB &= ~POWER_SWITCHES;
+    PORTB &= ~POWER_RELAYS;
+    powerUpCommands = commandsCounter;
+    power_enter(Power_Off, TICKS_MS(60));
+}
 
-        PORTB |= POWER_SWITCHES;
-        _delay_ms(50);
+//turn switches off for a while, touch switches recalibrate after power up
+void recalibrate_switches() {
+    input_suspend();
 
-        PORTB |= POWER_RELAYS;    
-        _delay_ms(50);
-    }; sei();
+    PORTB &= ~POWER_SWITCHES;
+    power_enter(Power_SwitchesOff, TICKS_MS(800));
+}
+
+bool power_ready() {
+    return (powerState == Power_Ready);
+}
+
+//the newest state from the journal
+OutputMask eeprom_restore_state_mask() {
+    OutputMask newMask = 0x00;
+
+    init_storage();
+
+    if ( !storage_restoreMask(&newMask) ) {
+        //the values in old format are spread in 8 bytes
+        uint8_t outputValues[8] = { 0 };
+        eeprom_read_block((uint8_t *)outputValues, (const uint8_t *)storedOutputValues, 8);
+
+        for ( int i=0; i<8; i++ ) {
+            newMask |= outputValues[i] ? OUTPUT_BIT(i) : 0;
+        }
+    }
+
+    return newMask;
+}
+
+//journal skips unchanged states and writes from interrupt, so it's cheap to call
+//returns false if nothing was written, the state has to be saved on the next pass
+bool eeprom_save_state_mask() {
+    if ( output_sequenceActive() ) {
+        return false; //only the final state is worth a record
+    }
+
+    outputStateNeedsToBeSaved = false;
+    storage_saveMask(currentOutputStateMask());
+    return true;
+}
+
+void eeprom_save_address() {
+    uint8_t address = chain_address(chainIndex);
+    if ( eeprom_read_byte(&i2c_address_num) != address ) {
+        eeprom_write_byte(&i2c_address_num, address);
+
+        uint8_t sreg = SREG;
+        cli();
+        counters_increment(Counter_EepromWrites);
+        SREG = sreg;
+    }
+
+    if ( eeprom_read_byte(&i2c_chain_index) != chainIndex ) {
+        eeprom_write_byte(&i2c_chain_index, chainIndex);
+
+        uint8_t sreg = SREG;
+        cli();
+        counters_increment(Counter_EepromWrites);
+        SREG = sreg;
+    }
 }
 
-//the values in EEPROM are spread in 8 bytes, probably for a better data retention
-void eeprom_restore_state_mask() {
-    uint8_t outputValues[8] = { 0 };
-    uint8_t newMask = 0x00;
-    eeprom_read_block((uint8_t *)outputValues, (const uint8_t *)storedOutputValues, 8);
+//only changed slots are written, it's a rare and slow operation
+void eeprom_save_groups() {
+    for ( uint8_t i=0; i<I2C_GROUPS_COUNT; i++ ) {
+        uint8_t group = i2c_group(i);
+        if ( eeprom_read_byte(&i2c_group_ids[i]) == group ) {
+            continue;
+        }
+
+        eeprom_write_byte(&i2c_group_ids[i], group);
 
-    for ( int i=0; i<8; i++ ) {
-        newMask |= outputValues[i] ? _BV(i) : 0;
+        uint8_t sreg = SREG;
+        cli();
+        counters_increment(Counter_EepromWrites);
+        SREG = sreg;
     }
+}
 
-    setOutputStateMaskSlowly(newMask);
+void eeprom_restore_groups() {
+    for ( uint8_t i=0; i<I2C_GROUPS_COUNT; i++ ) {
+        i2c_setGroup(i, eeprom_read_byte(&i2c_group_ids[i])); //erased eeprom is a free slot
+    }
 }
 
-void eeprom_save_state_mask() {
-    uint8_t outputValues[8] = { 0 };
-    uint8_t currentMask = currentOutputStateMask();
+//refresh register block for the master
+void update_registers() {
+    cli(); {
+        i2c_setRegister(Register_OutputMask, OUTPUT_BYTE(currentOutputStateMask(), 0));
+        i2c_setRegister(Register_InputLevels, input_currentLevels());
+        i2c_setRegister(Register_CommandsLow, commandsCounter & 0xFF);
+        i2c_setRegister(Register_CommandsHigh, commandsCounter >> 8);
+        i2c_setRegister(Register_PendingEvents, input_eventsCount());
+        i2c_setRegister(Register_QueueSize, I2C_COMMANDS_QUEUE_SIZE);
+        i2c_setRegister(Register_QueueHighWater, i2c_queueHighWater());
+        i2c_setRegister(Register_RejectedFrames, i2c_rejectedFrames());
+        i2c_setRegister(Register_ChainIndex, chainIndex);
+    }; sei();
+}
 
-    for ( int i=0; i<8; i++ ) {
-        outputValues[i] = ((currentMask & _BV(i)) != 0) ? 0xFF : 0x00;
+//turn off blue led after a short blink
+void command_led_tick() {
+    if ( commandLedTicks > 0 && --commandLedTicks == 0 ) {
+        PORTC &= ~(REMOTE_COMMAND_LED);
     }
+}
 
-    eeprom_write_block((const uint8_t *)outputValues, (uint8_t *)storedOutputValues, 8);
+void systick_each_tick() {
+    input_sample(); //debounce switches
+    output_tick(); //staggered relay sequence
+    power_tick(); //power lines
+    command_led_tick();
+    timers_tick(); //pulses and auto-off
 }
 
 //use slow 16-bit timer to measure 5 seconds intervals and trigger several timeouts
@@ -231,90 +835,214 @@ void each_5_seconds() {
         needsEepromSave = outputStateNeedsToBeSaved;
         eepromWriteTimeout = 0;
     }
+
+    chain_repeat();
+
+    if ( needsLongTimeReset || needsEepromSave || groupsNeedToBeSaved || addressNeedsToBeSaved
+            || scenes_needSaving() || rules_needSaving() || timers_needSaving() ) {
+        dispatch_post(Task_Housekeeping);
+    }
 }
 
 ISR(TIMER1_COMPA_vect) {
+    counters_increment(Counter_TIMER1_COMPA);
     each_5_seconds();
 }
 
-int main() {
-    MCUSR &= ~_BV(WDRF); //clear watchdog reset flag     
-    wdt_disable(); //disable watchdog
+//timer1 is stopped in power down, watchdog wakes us every second to keep counting
+ISR(WDT_vect) {
+    counters_increment(Counter_WDT);
+
+    static uint8_t seconds = 0x00;
+
+    if ( ++seconds == 5 ) {
+        each_5_seconds();
+        seconds = 0;
+    }
+}
+
+//watchdog interrupt instead of reset, call with interrupts disabled
+void watchdog_wake_up_mode() {
+    wdt_reset();
+    WDTCSR = _BV(WDCE) | _BV(WDE); //timed sequence, next write within 4 cycles
+    WDTCSR = _BV(WDIE) | _BV(WDP2) | _BV(WDP1); //1 second
+}
+
+//nothing is timed by the system tick and the bus is quiet, clocks can be stopped
+bool can_power_down() {
+    return power_ready()
+        && commandLedTicks == 0
+        && !input_sampling()
+        && !output_sequenceActive()
+        && !output_busy()
+        && !timers_active()
+        && !iface_busy()
+        && !storage_busy()
+        && !i2c_busy();
+}
+
+//idle keeps the system tick running, power down wakes only on
+//i2c address match, pin change (switches, test button, address line) or watchdog
+static uint16_t awakeSince = 0x0000; //timer1 value after the last wake up
+
+void go_to_sleep() {
+    cli();
+
+    if ( dispatch_pending(0xFF) ) {
+        sei(); //interrupt has posted a new task, run it first
+        return;
+    }
+
+    //timer1 runs in CTC mode, it could have wrapped around once
+    uint16_t now = TCNT1;
+    uint16_t awakeTime = (now >= awakeSince) ? (now - awakeSince) : (now + OCR1A + 1 - awakeSince);
+    counters_max(Counter_MaxLoopTime, awakeTime);
+
+    bool powerDown = can_power_down();
+    if ( powerDown ) {
+        watchdog_wake_up_mode();
+        set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    } else {
+        set_sleep_mode(SLEEP_MODE_IDLE); //system tick wakes us every 10ms, watchdog can stay armed
+    }
+
+    sleep_enable();
+    sei(); //next instruction runs before any interrupt, so a wake up can't be missed
+    sleep_cpu();
+    sleep_disable();
 
+    cli(); {
+        counters_increment(Counter_Wakes);
+        awakeSince = TCNT1;
+    }; sei();
+
+    if ( powerDown ) {
+        wdt_enable(WDTO_1S); //back to reset mode
+    }
+}
+
+//eeprom save and hourly recalibration, after commands are done
+void housekeeping() {
+    //do we have a new values state?
+    if ( needsEepromSave && eeprom_save_state_mask() ) {
+        needsEepromSave = false; //otherwise each_5_seconds() brings us back here
+    }
+
+    //address, group membership and scenes go to eeprom when the journal is not writing, or on the next pass
+    if ( addressNeedsToBeSaved && !storage_busy() ) {
+        eeprom_save_address();
+        addressNeedsToBeSaved = false;
+    }
+
+    if ( groupsNeedToBeSaved && !storage_busy() ) {
+        eeprom_save_groups();
+        groupsNeedToBeSaved = false;
+    }
+
+    if ( scenes_needSaving() && !storage_busy() ) {
+        scenes_save();
+    }
+
+    if ( rules_needSaving() && !storage_busy() ) {
+        rules_save();
+    }
+
+    if ( timers_needSaving() && !storage_busy() ) {
+        timers_save();
+    }
+
+    //reset everything each hour, allowing touch switches to recalibrate
+    if ( needsLongTimeReset && power_ready() ) {
+        recalibrate_switches(); //runs on system tick, we can go to sleep
+        needsLongTimeReset = false;
+    }
+}
+
+//run pending tasks, i2c commands first
+void run_pending_tasks() {
+    uint8_t tasks = dispatch_take();
+
+    if ( tasks & Task_I2C ) {
+        process_i2c();
+    }
+
+    if ( tasks & Task_Output ) {
+        process_output();
+    }
+
+    if ( tasks & Task_Interface ) {
+        process_interface();
+    }
+
+    if ( tasks & Task_Housekeeping ) {
+        if ( dispatch_pending(Task_I2C | Task_Output) ) {
+            dispatch_post(Task_Housekeeping); //new commands have arrived, eeprom can wait
+        } else {
+            housekeeping();
+        }
+    }
+
+    if ( tasks != 0x00 ) {
+        update_registers(); //every task may change something the master reads
+    }
+}
+
+//everything that has to be done once after power up
+void init_board() {
     cli(); {
         //init PORTs, DDRs and PINs
         init_ports();
 
-        //init periodic timer
+        //init periodic timers
         init_timeout_timer();
+        init_systick();
 
         //slowly turn power to relays and switches
         delayed_power_sequence();
 
-        //reload stored values from eeprom
-        eeprom_restore_state_mask();
-
-        //declare i2c read commands
-        char readCommands[] = {Command_GetPortValue, Command_GetAllPortBits};
-        i2c_setReadCommands(readCommands , 2);
+        //reload stored values from eeprom, they are applied when relays have power
+        restoredOutputMask = eeprom_restore_state_mask();
 
         //restore i2c address from eeprom
         uint8_t i2c_address = eeprom_read_byte((uint8_t *)&i2c_address_num);
         i2c_address &= 0x7F; //mask out one msb
         init_i2c(i2c_address);
-    }; sei();
-
-    //main loop
-    while(1) {
-        wdt_reset();
-
-        //everyone has their time on the loop
-        process_input();
-        process_i2c();
-        process_output();
-        process_interface();
 
-        //wait before going to sleep
-        _delay_ms(5);
-
-        if ( i2c_commandsAvailable() || output_hasNewState() ) {
-            continue; //skip sleep mode, repeat all processes
+        //the default address alone does not make a board the first one in the chain
+        uint8_t storedIndex = eeprom_read_byte(&i2c_chain_index);
+        if ( storedIndex < CHAIN_LENGTH_MAX && chain_address(storedIndex) == i2c_address ) {
+            chainIndex = storedIndex;
         }
+        eeprom_restore_groups();
+        init_scenes();
+        init_rules();
+        init_timers();
 
-        //do we have a new values state?
-        if ( needsEepromSave ) {
-            eeprom_save_state_mask();
-            needsEepromSave = false;
-        }
+        dispatch_post(Task_Registers); //fill register block
+    }; sei();
+}
 
-        //reset everything each hour, allowing touch switches to recalibrate
-        if ( needsLongTimeReset ) {
-            cli(); {
-                PORTB &= ~POWER_SWITCHES;
-                _delay_ms(800);
-                PORTB |= POWER_SWITCHES;
-                _delay_ms(100);
+int main() {
+    init_counters(MCUSR); //count watchdog resets before the flags are gone
+    MCUSR = 0x00; //clear all reset flags, watchdog flag would keep watchdog on
+    wdt_disable(); //disable watchdog
 
-                needsLongTimeReset = false;
-            }; sei();
-        }
+    init_board();
+    wdt_enable(WDTO_1S); //system tick wakes the main loop often enough
 
-        //turn off blue led
-        PORTC &= ~(REMOTE_COMMAND_LED);
+    //main loop
+    while(1) {
+        wdt_reset();
+
+        //only modules with pending work have their time on the loop
+        run_pending_tasks();
 
 #if DEBUG_MODE
         PORTD &= ~(DEBUG1|DEBUG2);
 #endif
 
-        //do not let watchdog reset us during sleep
-        wdt_disable();
-
-        //nothing to do, go to idle sleep
-        set_sleep_mode(SLEEP_MODE_IDLE);
-        sleep_enable();
-        sleep_cpu();
-
-        wdt_enable(WDTO_1S); //restore watchdog timer
+        //nothing to do, sleep until the next interrupt
+        go_to_sleep();
     }
 
     return 0;  
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "relaymatic.h"
+#include "sim_slave.h"
+
+using namespace relaymatic;
+
+#define BOARDS      16
+#define CHANGES     20000
+#define BATCH       64 //changes between two flushes
+
+// random port changes all over the chain
+static void change(Chain &chain) {
+    chain.board(rand() % BOARDS).toggle(rand() % 8 + 1);
+}
+
+static void report(const char *name, SimulatedBus &bus, Chain &chain, unsigned long count) {
+    printf("%s_transfers_per_change %.3f\n", name, (double)chain.transfers()/count);
+    printf("%s_bytes_per_change %.2f\n", name, (double)bus.bytes/count);
+    printf("%s_changes_per_second_at_100khz %.0f\n", name, count/bus.busSeconds());
+}
+
+// flush after every change, as ad hoc masters do
+void bench_changeByChange() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    for ( uint8_t i=0; i<BOARDS; i++ ) {
+        bus.add(chainAddress(i));
+        chain.addChainIndex(i);
+    }
+
+    srand(1);
+    for ( long i=0; i<CHANGES; i++ ) {
+        change(chain);
+        chain.flush();
+    }
+    report("single", bus, chain, CHANGES);
+}
+
+// changes are cached, every flush sends one burst to every board in one transfer
+void bench_coalescedChanges() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    for ( uint8_t i=0; i<BOARDS; i++ ) {
+        bus.add(chainAddress(i));
+        chain.addChainIndex(i);
+    }
+
+    srand(1);
+    for ( long i=0; i<CHANGES; i++ ) {
+        change(chain);
+        if ( i % BATCH == BATCH-1 ) {
+            chain.flush();
+        }
+    }
+    report("coalesced", bus, chain, CHANGES);
+}
+
+// register blocks of the whole chain
+void bench_polls() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    for ( uint8_t i=0; i<BOARDS; i++ ) {
+        bus.add(chainAddress(i));
+        chain.addChainIndex(i);
+    }
+    chain.refresh();
+
+    unsigned long transfers = chain.transfers();
+    for ( long i=0; i<CHANGES/BOARDS; i++ ) {
+        chain.refresh();
+    }
+    printf("poll_transfers_per_refresh %.2f\n", (double)(chain.transfers() - transfers)/(CHANGES/BOARDS));
+    printf("refreshes_per_second_at_100khz %.0f\n", (CHANGES/BOARDS + 1)/bus.busSeconds());
+}
+
+int main() {
+    bench_changeByChange();
+    bench_coalescedChanges();
+    bench_polls();
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "linux_bus.h"
+
+namespace relaymatic {
+
+LinuxBus::LinuxBus(const char *device, const char *interruptGpio) {
+    busFd = open(device, O_RDWR);
+
+    if ( interruptGpio ) {
+        gpioFd = open(interruptGpio, O_RDONLY);
+    }
+}
+
+LinuxBus::~LinuxBus() {
+    if ( busFd >= 0 ) {
+        close(busFd);
+    }
+    if ( gpioFd >= 0 ) {
+        close(gpioFd);
+    }
+}
+
+//repeated start between the messages, stop after the last one
+size_t LinuxBus::transfer(std::vector<Message> &messages) {
+    if ( busFd < 0 || messages.empty() ) {
+        return 0;
+    }
+
+    std::vector<struct i2c_msg> parts(messages.size());
+    for ( size_t i=0; i<messages.size(); i++ ) {
+        parts[i].addr = messages[i].address;
+        parts[i].flags = messages[i].read ? I2C_M_RD : 0;
+        parts[i].len = messages[i].data.size();
+        parts[i].buf = messages[i].data.data();
+    }
+
+    struct i2c_rdwr_ioctl_data data = { parts.data(), (__u32)parts.size() };
+    int sent = ioctl(busFd, I2C_RDWR, &data);
+    return (sent >= 0) ? sent : 0; //only an error, not how far it got
+}
+
+bool LinuxBus::interruptRaised() {
+    char level = '0';
+    if ( gpioFd < 0 || pread(gpioFd, &level, 1, 0) != 1 ) {
+        return false;
+    }
+    return level == '1';
+}
+
+size_t LinuxBus::maxMessages() const {
+    return I2C_RDWR_IOCTL_MAX_MSGS;
+}
+
+}
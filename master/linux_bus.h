@@ -0,0 +1,40 @@
+/* -------------------------------------
+	<linux_bus.h>
+	• i2c adapter of a linux host, /dev/i2c-N
+	• a whole transfer goes out with one I2C_RDWR ioctl
+	• interrupt line from a gpio value file, if it is wired
+------------------------------------- */
+
+#ifndef LINUX_BUS_H
+#define LINUX_BUS_H
+
+#include "relaymatic.h"
+
+namespace relaymatic {
+
+class LinuxBus : public Bus {
+public:
+    // interruptGpio is a sysfs value file, e.g. /sys/class/gpio/gpio17/value, the line is active high
+    explicit LinuxBus(const char *device, const char *interruptGpio = nullptr);
+    ~LinuxBus();
+
+    bool isOpen() const { return busFd >= 0; }
+
+    size_t transfer(std::vector<Message> &messages) override;
+
+    bool hasInterruptLine() const override { return gpioFd >= 0; }
+    bool interruptRaised() override;
+
+    size_t maxMessages() const override;
+
+private:
+    int busFd = -1;
+    int gpioFd = -1;
+
+    LinuxBus(const LinuxBus &) = delete;
+    LinuxBus &operator=(const LinuxBus &) = delete;
+};
+
+}
+
+#endif
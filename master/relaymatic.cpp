@@ -0,0 +1,518 @@
+#include <algorithm>
+
+#include "relaymatic.h"
+
+namespace relaymatic {
+
+//first 8 boards: lsb 3 bits - device number, next 4 bits - device class
+uint8_t chainAddress(uint8_t index) {
+    if ( index < 8 ) {
+        return ((DEVICE_CLASS&0xF) << 3) | index;
+    }
+    return CHAIN_EXTENDED_FIRST + (index-8);
+}
+
+//read command and its answer, joined with a repeated start
+static void addRead(std::vector<Message> &part, uint8_t address, uint8_t command, uint8_t argument, size_t length) {
+    part.push_back({ address, false, { command, argument } });
+    part.push_back({ address, true, std::vector<uint8_t>(length, 0xFF) });
+}
+
+//sent twice it leaves the board as sent once: no toggles, pulses, scene stores or event reads,
+//'S' only after its own 'B', the mask byte pointer moves by itself
+static bool repeatable(const std::vector<Message> &part) {
+    for ( auto &message : part ) {
+        if ( message.read ) {
+            continue;
+        }
+
+        bool byteSelected = false;
+        for ( size_t i=0; i+1<message.data.size(); i+=2 ) {
+            switch ( message.data[i] ) {
+                case Command_SelectMaskByte:
+                    byteSelected = true;
+                    break;
+                case Command_SetAllPortBits:
+                    if ( !byteSelected ) {
+                        return false;
+                    }
+                    break;
+                case Command_SetPortValue:
+                case Command_SwitchPortOn:
+                case Command_SwitchPortOff:
+                case Command_AllSwitchOff:
+                case Command_AllSwitchOn:
+                case Command_StageCommands:
+                case Command_SelectTimerLength:
+                case Command_SelectRegister:
+                case Command_GetPortValue:
+                case Command_GetAllPortBits:
+                case Command_GetCounters:
+                case Command_GetScenes:
+                case Command_GetRules:
+                case Command_GetTimers:
+                case Command_GetGroups:
+                    break;
+                default:
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* ------------- board ------------ */
+
+Board::Board(uint8_t address, uint8_t outputBytes)
+    : boardAddress(address), outputBytes(std::max<uint8_t>(1, std::min(outputBytes, OUTPUT_BYTES_MAX))) {
+}
+
+void Board::set(uint8_t port, bool on) {
+    if ( port == 0 || port > outputCount() ) {
+        return;
+    }
+
+    Mask bit = (Mask)1 << (port-1);
+    target = on ? (target | bit) : (target & ~bit);
+}
+
+void Board::toggle(uint8_t port) {
+    if ( port == 0 || port > outputCount() ) {
+        return;
+    }
+    target ^= (Mask)1 << (port-1);
+}
+
+void Board::setOutputs(Mask mask) {
+    Mask all = (outputBytes < 8) ? (((Mask)1 << outputCount()) - 1) : ~(Mask)0;
+    target = mask & all;
+}
+
+bool Board::output(uint8_t port) const {
+    return port > 0 && port <= outputCount() && (target & ((Mask)1 << (port-1))) != 0;
+}
+
+//output changes made before the command go out before it
+void Board::command(uint8_t command, uint8_t argument) {
+    queueOutputWrites();
+
+    writes.push_back(command);
+    writes.push_back(argument);
+    stale = true;
+}
+
+bool Board::hasPendingWrites() const {
+    return !writes.empty() || target != expected;
+}
+
+uint16_t Board::executedCommands() const {
+    return registers[Register_CommandsLow] | (registers[Register_CommandsHigh] << 8);
+}
+
+uint8_t Board::queueSize() const {
+    return (registers[Register_QueueSize] != 0) ? registers[Register_QueueSize] : DEFAULT_QUEUE_SIZE;
+}
+
+std::vector<Event> Board::takeEvents() {
+    std::vector<Event> taken;
+    taken.swap(events);
+    overflowed = false;
+    return taken;
+}
+
+//either 'o'/'x' for every changed port, or 'S' for the changed mask bytes, whichever is shorter,
+//all of them are safe to repeat if a transfer fails
+void Board::queueOutputWrites() {
+    Mask changed = target ^ expected;
+    if ( changed == 0 ) {
+        return;
+    }
+
+    uint8_t first = outputBytes, last = 0;
+    for ( uint8_t byte=0; byte<outputBytes; byte++ ) {
+        if ( changed & byteMask(byte) ) {
+            first = std::min(first, byte);
+            last = byte;
+        }
+    }
+
+    size_t bytePairs = (last-first+1) + (outputBytes > 1 ? 1 : 0); //wider masks need 'B' first
+    size_t portPairs = __builtin_popcountll(changed);
+
+    if ( portPairs <= bytePairs ) {
+        for ( uint8_t port=1; port<=outputCount(); port++ ) {
+            Mask bit = (Mask)1 << (port-1);
+            if ( changed & bit ) {
+                writes.push_back((target & bit) ? Command_SwitchPortOn : Command_SwitchPortOff);
+                writes.push_back(port);
+            }
+        }
+    } else {
+        if ( outputBytes > 1 ) {
+            writes.push_back(Command_SelectMaskByte);
+            writes.push_back(first);
+        }
+        for ( uint8_t byte=first; byte<=last; byte++ ) {
+            writes.push_back(Command_SetAllPortBits); //mask byte pointer moves by itself
+            writes.push_back((target >> (byte*8)) & 0xFF);
+        }
+    }
+
+    expected = target;
+}
+
+//cached changes stay, they are sent against the new mask
+void Board::updateConfirmed(Mask mask) {
+    bool idle = writes.empty() && target == expected;
+
+    confirmed = mask;
+    expected = mask;
+    stale = false;
+
+    if ( idle ) {
+        target = mask; //switches or timers have changed outputs on the board
+    }
+}
+
+//header byte (number of events, msb — some were lost), then 3 bytes for every event
+void Board::parseEvents(const std::vector<uint8_t> &answer) {
+    uint8_t count = answer[0] & 0x7F;
+    overflowed = overflowed || (answer[0] & 0x80) != 0;
+
+    for ( size_t i=0; i<count && 3*i+3<answer.size(); i++ ) {
+        uint8_t info = answer[1 + 3*i];
+        uint16_t time = answer[2 + 3*i] | (answer[3 + 3*i] << 8);
+
+        events.push_back({ (uint8_t)(info & 0x07), (info & 0x08) != 0, (uint8_t)((info >> 4) & 0x03), time });
+    }
+}
+
+/* ------------- chain ------------ */
+
+Board &Chain::add(uint8_t address, uint8_t outputBytes) {
+    Board *known = find(address);
+    if ( known ) {
+        return *known;
+    }
+
+    boards.emplace_back(new Board(address, outputBytes));
+    return *boards.back();
+}
+
+Board *Chain::find(uint8_t address) {
+    for ( auto &board : boards ) {
+        if ( board->boardAddress == address ) {
+            return board.get();
+        }
+    }
+    return nullptr;
+}
+
+std::vector<bool> Chain::transferAll(std::vector<std::vector<Message>> &parts, const std::vector<bool> &alone) {
+    std::vector<bool> taken(parts.size(), false);
+
+    //boards that refused last time go alone at the end, so they don't hold the others back
+    std::vector<size_t> order;
+    for ( size_t i=0; i<parts.size(); i++ ) {
+        if ( !alone[i] ) {
+            order.push_back(i);
+        }
+    }
+    for ( size_t i=0; i<parts.size(); i++ ) {
+        if ( alone[i] ) {
+            order.push_back(i);
+        }
+    }
+
+    //without progress nobody knows which part of a failed transfer went through
+    bool exact = bus.reportsProgress();
+
+    size_t next = 0;
+    while ( next < order.size() ) {
+        size_t first = next;
+        std::vector<Message> messages;
+
+        while ( next < order.size() ) {
+            size_t i = order[next];
+            bool fits = messages.size() + parts[i].size() <= bus.maxMessages();
+            bool single = alone[i] || (!exact && !repeatable(parts[i]));
+            if ( !messages.empty() && (!fits || single) ) {
+                break;
+            }
+            messages.insert(messages.end(), parts[i].begin(), parts[i].end());
+            next++;
+            if ( single ) {
+                break;
+            }
+        }
+
+        transferCount++;
+        size_t acknowledged = bus.transfer(messages);
+
+        if ( !exact && acknowledged != messages.size() ) {
+            if ( next - first == 1 ) {
+                continue; //the only part, refused
+            }
+
+            //all of them are repeatable, each goes again alone to find the refusing one
+            for ( size_t n=first; n<next; n++ ) {
+                std::vector<Message> &part = parts[order[n]];
+                transferCount++;
+                taken[order[n]] = (bus.transfer(part) == part.size());
+            }
+            continue;
+        }
+
+        size_t m = 0;
+        for ( size_t n=first; n<next; n++ ) {
+            std::vector<Message> &part = parts[order[n]];
+            if ( m + part.size() > acknowledged ) {
+                next = n+1; //this one refused, the rest was not sent and goes with the next transfer
+                break;
+            }
+
+            for ( auto &message : part ) {
+                message.data = messages[m++].data; //answers to the reads
+            }
+            taken[order[n]] = true;
+        }
+    }
+
+    return taken;
+}
+
+//bursts are as long as the board queue, the next burst waits for the next transfer,
+//so the board has emptied its queue by then
+bool Chain::flush() {
+    for ( auto &board : boards ) {
+        board->queueOutputWrites();
+        board->writesSent = 0;
+    }
+
+    bool ok = true;
+    while ( true ) {
+        std::vector<std::vector<Message>> parts;
+        std::vector<Board *> owners;
+        std::vector<bool> alone;
+        std::vector<size_t> pairs;
+
+        for ( auto &board : boards ) {
+            size_t pairsLeft = board->writes.size()/2 - board->writesSent;
+            if ( pairsLeft == 0 ) {
+                continue;
+            }
+
+            size_t burst = std::min(pairsLeft, (size_t)board->queueSize());
+            auto begin = board->writes.begin() + board->writesSent*2;
+
+            parts.push_back({ { board->boardAddress, false, std::vector<uint8_t>(begin, begin + burst*2) } });
+            owners.push_back(board.get());
+            alone.push_back(!board->isOnline);
+            pairs.push_back(burst);
+        }
+
+        if ( parts.empty() ) {
+            break;
+        }
+
+        std::vector<bool> taken = transferAll(parts, alone);
+
+        for ( size_t i=0; i<owners.size(); i++ ) {
+            Board *board = owners[i];
+            board->isOnline = taken[i];
+
+            if ( !taken[i] ) {
+                //other commands are dropped, output changes go again with the next flush
+                board->writes.clear();
+                board->writesSent = 0;
+                board->expected = board->confirmed;
+                board->stale = true;
+                ok = false;
+                continue;
+            }
+
+            board->writesSent += pairs[i];
+            if ( board->writesSent*2 == board->writes.size() ) {
+                board->writes.clear();
+                board->writesSent = 0;
+                board->confirmed = board->expected;
+            }
+        }
+    }
+
+    return ok;
+}
+
+//relays of all boards switch at the same moment, boards with pending writes have to be in the group
+bool Chain::flushTogether(uint8_t group) {
+    std::vector<Board *> staged;
+
+    for ( auto &board : boards ) {
+        board->queueOutputWrites();
+        if ( !board->writes.empty() ) {
+            uint8_t stage[] = { Command_StageCommands, 0x01 };
+            board->writes.insert(board->writes.begin(), stage, stage+2);
+            staged.push_back(board.get());
+        }
+    }
+
+    if ( staged.empty() ) {
+        return true;
+    }
+
+    bool ok = flush();
+
+    std::vector<Message> commit = { { GENERAL_CALL_ADDRESS, false, { group, Command_CommitStaged, 0x00 } } };
+    transferCount++;
+    if ( bus.transfer(commit) != commit.size() ) {
+        for ( Board *board : staged ) {
+            board->stale = true; //nobody knows what was applied
+        }
+        return false;
+    }
+
+    return ok;
+}
+
+bool Chain::refresh() {
+    std::vector<std::vector<Message>> parts;
+    std::vector<bool> alone;
+
+    //register blocks of all boards
+    for ( auto &board : boards ) {
+        parts.emplace_back();
+        addRead(parts.back(), board->boardAddress, Command_SelectRegister, Register_OutputMask, REGISTERS_POLLED);
+        alone.push_back(!board->isOnline);
+    }
+
+    std::vector<bool> taken = transferAll(parts, alone);
+
+    bool ok = true;
+    for ( size_t i=0; i<boards.size(); i++ ) {
+        Board *board = boards[i].get();
+        board->isOnline = taken[i];
+        if ( !taken[i] ) {
+            ok = false;
+            continue;
+        }
+
+        std::copy(parts[i][1].data.begin(), parts[i][1].data.end(), board->registers);
+        if ( board->outputBytes == 1 ) {
+            board->updateConfirmed(board->registers[Register_OutputMask]);
+        }
+    }
+
+    //switch events and masks that don't fit into the register block, in the next transfer
+    std::vector<Board *> owners;
+    parts.clear();
+    alone.clear();
+
+    for ( auto &board : boards ) {
+        if ( !board->isOnline ) {
+            continue;
+        }
+
+        std::vector<Message> part;
+        uint8_t pendingEvents = board->registers[Register_PendingEvents];
+        if ( pendingEvents > 0 ) {
+            addRead(part, board->boardAddress, Command_GetEvents, 0x00, 1 + 3*pendingEvents);
+        }
+        if ( board->outputBytes > 1 || board->stale ) {
+            addRead(part, board->boardAddress, Command_GetAllPortBits, 0x00, board->outputBytes);
+        }
+
+        if ( !part.empty() ) {
+            parts.push_back(part);
+            owners.push_back(board.get());
+            alone.push_back(false);
+        }
+    }
+
+    //the line stays raised until the board is read with a command, a register read is not enough
+    if ( bus.hasInterruptLine() && bus.interruptRaised() ) {
+        for ( auto &board : boards ) {
+            if ( board->isOnline && std::find(owners.begin(), owners.end(), board.get()) == owners.end() ) {
+                parts.emplace_back();
+                addRead(parts.back(), board->boardAddress, Command_GetAllPortBits, 0x00, board->outputBytes);
+                owners.push_back(board.get());
+                alone.push_back(false);
+            }
+        }
+    }
+
+    taken = transferAll(parts, alone);
+
+    for ( size_t i=0; i<owners.size(); i++ ) {
+        Board *board = owners[i];
+        if ( !taken[i] ) {
+            board->isOnline = false;
+            ok = false;
+            continue;
+        }
+
+        for ( size_t m=0; m+1<parts[i].size(); m+=2 ) {
+            uint8_t command = parts[i][m].data[0];
+            const std::vector<uint8_t> &answer = parts[i][m+1].data;
+
+            if ( command == Command_GetEvents ) {
+                board->parseEvents(answer);
+            } else {
+                Mask mask = 0;
+                for ( uint8_t byte=0; byte<board->outputBytes; byte++ ) {
+                    mask |= (Mask)answer[byte] << (byte*8);
+                }
+                board->updateConfirmed(mask);
+            }
+        }
+    }
+
+    return ok;
+}
+
+size_t Chain::discover(uint8_t outputBytes) {
+    std::vector<std::vector<Message>> parts;
+    std::vector<uint8_t> addresses;
+
+    for ( uint8_t index=0; index<CHAIN_LENGTH_MAX; index++ ) {
+        uint8_t address = chainAddress(index);
+        if ( !find(address) ) {
+            parts.emplace_back();
+            addRead(parts.back(), address, Command_SelectRegister, Register_OutputMask, REGISTERS_POLLED);
+            addresses.push_back(address);
+        }
+    }
+
+    std::vector<bool> taken = transferAll(parts, std::vector<bool>(parts.size(), false));
+
+    size_t added = 0;
+    for ( size_t i=0; i<parts.size(); i++ ) {
+        if ( taken[i] ) {
+            Board &board = add(addresses[i], outputBytes);
+            std::copy(parts[i][1].data.begin(), parts[i][1].data.end(), board.registers);
+            added++;
+        }
+    }
+    return added;
+}
+
+bool Chain::service() {
+    bool ok = true;
+
+    if ( !bus.hasInterruptLine() || bus.interruptRaised() ) {
+        ok = refresh();
+
+        //nobody we know keeps it raised, a board has got an address
+        if ( bus.hasInterruptLine() && bus.interruptRaised() && discover() > 0 ) {
+            ok = refresh() && ok;
+        }
+    }
+
+    for ( auto &board : boards ) {
+        if ( board->hasPendingWrites() ) {
+            return flush() && ok;
+        }
+    }
+    return ok;
+}
+
+}
@@ -0,0 +1,204 @@
+/* -------------------------------------
+	<relaymatic.h>
+	• master side of the i2c protocol, for linux hosts
+	• a chain of boards with a cached shadow state
+	• output changes are coalesced per board and sent as bursts
+	• bursts and polls of all boards go out in one bus transfer
+	• interrupt line tells when boards have something new
+------------------------------------- */
+
+#ifndef RELAYMATIC_H
+#define RELAYMATIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <vector>
+#include <memory>
+
+#include "commands.h" //the same table the firmware is built from
+
+namespace relaymatic {
+
+/* PROTOCOL */
+// command bytes, see COMMANDS_TABLE
+#define RELAYMATIC_COMMAND_BYTE(byte, name, kind, mask, min, max) Command_##name = byte,
+enum Commands : uint8_t {
+    COMMANDS_TABLE(RELAYMATIC_COMMAND_BYTE)
+};
+#undef RELAYMATIC_COMMAND_BYTE
+
+// register block, the same as enum Registers in main.c
+enum Registers : uint8_t {
+    Register_OutputMask = 0x00, //first byte of the mask only
+    Register_InputLevels = 0x01,
+    Register_InputEvents = 0x02,
+    Register_CommandsLow = 0x03,
+    Register_CommandsHigh = 0x04,
+    Register_PendingEvents = 0x05,
+    Register_QueueSize = 0x06,
+    Register_QueueHighWater = 0x07,
+    Register_RejectedFrames = 0x08,
+    Register_ChainIndex = 0x09,
+    REGISTERS_POLLED, //read by every poll
+};
+
+const uint8_t DEVICE_CLASS = 0x0E;
+const uint8_t CHAIN_EXTENDED_FIRST = 0x10;
+const uint8_t CHAIN_LENGTH_MAX = 8 + 0x70-CHAIN_EXTENDED_FIRST; //0x70-0x77 and 0x10-0x6F
+const uint8_t GENERAL_CALL_ADDRESS = 0x00;
+const uint8_t GROUP_ALL = 0xFF; //every board is a member, see i2c.h
+
+const uint8_t DEFAULT_QUEUE_SIZE = 16; //until the first poll tells the real one
+const uint8_t OUTPUT_BYTES_MAX = 8;
+
+typedef uint64_t Mask; //wide enough for any board, bit 0 is port 1
+
+// address of a board at the given chain position, see chain_address() in main.c
+uint8_t chainAddress(uint8_t index);
+
+// switch event, see InputEvent in input.h
+struct Event {
+    uint8_t pin;
+    bool pressed; //falling edge, switch became active
+    uint8_t pressType; //see InputPressTypes
+    uint16_t time; //board system ticks
+};
+
+/* BUS */
+// one part of a transfer, the same as struct i2c_msg
+struct Message {
+    uint8_t address; //GENERAL_CALL_ADDRESS for group frames
+    bool read;
+    std::vector<uint8_t> data; //bytes to write, or room for the bytes to read
+};
+
+class Bus {
+public:
+    virtual ~Bus() {}
+
+    // messages are joined with repeated starts, the first one not acknowledged ends the transfer,
+    // returns how many messages went through before it, messages.size() if all of them did
+    virtual size_t transfer(std::vector<Message> &messages) = 0;
+
+    // false when a failed transfer only tells an error (I2C_RDWR), any part of it may have gone through
+    virtual bool reportsProgress() const { return false; }
+
+    // interrupt line of the chain, without one every service polls all boards
+    virtual bool hasInterruptLine() const { return false; }
+    virtual bool interruptRaised() { return false; }
+
+    // the most messages one transfer takes
+    virtual size_t maxMessages() const { return 42; }
+};
+
+/* BOARD */
+// shadow state of one board, changes are cached until Chain::flush()
+class Board {
+public:
+    Board(uint8_t address, uint8_t outputBytes);
+
+    uint8_t address() const { return boardAddress; }
+    uint8_t outputCount() const { return outputBytes*8; }
+
+    // port numbers start from 1, as in the protocol
+    void set(uint8_t port, bool on);
+    void toggle(uint8_t port);
+    void setOutputs(Mask mask);
+
+    // any other command from the table, sent in order with the output changes;
+    // outputs are read back by the next refresh, commands that change them are not modelled here
+    void command(uint8_t command, uint8_t argument);
+
+    bool hasPendingWrites() const;
+
+    // outputs with the cached changes applied
+    bool output(uint8_t port) const;
+    Mask outputs() const { return target; }
+
+    // outputs the board has reported or acknowledged
+    Mask confirmedOutputs() const { return confirmed; }
+
+    // register block as of the last refresh
+    bool online() const { return isOnline; }
+    uint8_t inputLevels() const { return registers[Register_InputLevels]; }
+    uint16_t executedCommands() const;
+    uint8_t queueSize() const;
+    uint8_t rejectedFrames() const { return registers[Register_RejectedFrames]; }
+    uint8_t chainIndex() const { return registers[Register_ChainIndex]; }
+
+    // switch events received so far, the board has forgotten them already
+    std::vector<Event> takeEvents();
+    bool eventsOverflowed() const { return overflowed; }
+
+private:
+    friend class Chain;
+
+    uint8_t boardAddress;
+    uint8_t outputBytes;
+    bool isOnline = true; //answered the last time it was addressed
+
+    Mask target = 0; //what the user wants
+    Mask expected = 0; //what the board has once the pending writes are through
+    Mask confirmed = 0;
+    bool stale = true; //confirmed mask is not known, read it with the next refresh
+
+    std::vector<uint8_t> writes; //(command, argument) pairs in order
+    size_t writesSent = 0; //pairs of the current flush already acknowledged
+
+    uint8_t registers[REGISTERS_POLLED] = {};
+    std::vector<Event> events;
+    bool overflowed = false;
+
+    void queueOutputWrites(); //output changes up to now become pairs
+    void updateConfirmed(Mask mask); //mask read from the board
+    void parseEvents(const std::vector<uint8_t> &answer); //see events_readByte() in main.c
+    Mask byteMask(uint8_t byte) const { return (Mask)0xFF << (byte*8); }
+};
+
+/* CHAIN */
+class Chain {
+public:
+    explicit Chain(Bus &bus) : bus(bus) {}
+
+    Board &add(uint8_t address, uint8_t outputBytes = 1);
+    Board &addChainIndex(uint8_t index, uint8_t outputBytes = 1) { return add(chainAddress(index), outputBytes); }
+
+    size_t size() const { return boards.size(); }
+    Board &board(size_t i) { return *boards[i]; }
+    Board *find(uint8_t address);
+
+    // pending writes of all boards, one burst of every board per transfer,
+    // false if some board did not take its writes, output writes are repeated by the next flush
+    bool flush();
+
+    // the same, but boards stage the writes and switch together on a general call to the group
+    bool flushTogether(uint8_t group = GROUP_ALL);
+
+    // poll registers of all boards in one transfer, then drain events and read wide masks
+    bool refresh();
+
+    // look for boards at chain addresses not known yet, returns how many were added
+    size_t discover(uint8_t outputBytes = 1);
+
+    // refresh if the interrupt line is raised, discover if it stays raised, then flush
+    bool service();
+
+    // bus usage, for benchmarks
+    unsigned long transfers() const { return transferCount; }
+
+private:
+    Bus &bus;
+    std::vector<std::unique_ptr<Board>> boards;
+    unsigned long transferCount = 0;
+
+    // messages of every board go out packed in as few transfers as the bus takes,
+    // parts before the refusing one are taken, the ones after it go again, none is sent twice,
+    // a bus that does not report progress only gets parts safe to repeat together, see repeatable(),
+    // true for boards that took theirs
+    std::vector<bool> transferAll(std::vector<std::vector<Message>> &parts, const std::vector<bool> &alone);
+};
+
+}
+
+#endif
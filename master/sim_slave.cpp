@@ -0,0 +1,402 @@
+#include <algorithm>
+
+#include "sim_slave.h"
+
+namespace relaymatic {
+
+// sizes the table checks arguments against, the same as in the default firmware build
+#define OUTPUT_BYTES            outputBytes
+#define OUTPUT_COUNT            (outputBytes*8)
+#define SCENES_COUNT            8
+#define RULES_COUNT             32
+#define RULE_ACTIONS_COUNT      7
+#define COUNTERS_COUNT          19
+#define I2C_REGISTERS_COUNT     16
+#define I2C_GROUP_ALL           GROUP_ALL
+#define I2C_GROUPS_COUNT        4
+
+//kind of a command byte, see CommandKinds
+static uint8_t commandKind(uint8_t command) {
+    switch ( command ) {
+#define SIM_COMMAND_KIND(byte, name, kind, mask, min, max) case byte: return kind;
+        COMMANDS_TABLE(SIM_COMMAND_KIND)
+#undef SIM_COMMAND_KIND
+    }
+    return Command_Invalid;
+}
+
+//position of an enumerated board, the inverse of chain_address() in main.c
+static uint8_t chainIndex(uint8_t address) {
+    if ( (address >> 3) == (DEVICE_CLASS&0xF) ) {
+        return address & 0x07;
+    } else if ( address >= CHAIN_EXTENDED_FIRST && address < ((DEVICE_CLASS&0xF) << 3) ) {
+        return address - CHAIN_EXTENDED_FIRST + 8;
+    }
+    return 0xFF;
+}
+
+SimulatedSlave::SimulatedSlave(uint8_t address, uint8_t outputBytes, uint8_t queueSize)
+    : slaveAddress(address), outputBytes(outputBytes), queueSize(queueSize) {
+}
+
+bool SimulatedSlave::validArgument(uint8_t command, uint8_t argument) const {
+    switch ( command ) {
+#define SIM_COMMAND_ARGUMENT(byte, name, kind, mask, min, max) \
+        case byte: return (mask) == 0x00 || ((argument & (mask)) >= (min) && (argument & (mask)) <= (max));
+        COMMANDS_TABLE(SIM_COMMAND_ARGUMENT)
+#undef SIM_COMMAND_ARGUMENT
+    }
+    return false;
+}
+
+bool SimulatedSlave::isGroupMember(uint8_t group) const {
+    if ( group == GROUP_ALL ) {
+        return true;
+    }
+
+    for ( uint8_t slot : groups ) {
+        if ( slot == group && group != 0x00 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//every byte is acknowledged or not before the next one comes, as TWEA works
+size_t SimulatedSlave::write(const uint8_t *bytes, size_t count, bool generalCall) {
+    bool queueFull = (queue.size() >= queueSize);
+    bool ack = !queueFull; //address is acknowledged, commands only if there is room
+    bool groupByte = generalCall;
+    bool hasCommand = false;
+    bool first = true; //the mask byte pointer starts over with this transaction
+    uint8_t command = 0x00;
+    size_t acknowledged = 0;
+
+    for ( size_t i=0; i<count; i++ ) {
+        if ( !ack ) {
+            if ( queueFull ) {
+                rejected++; //master wanted to send one more frame
+            }
+            return acknowledged;
+        }
+        acknowledged++;
+
+        uint8_t byte = bytes[i];
+        if ( groupByte ) {
+            groupByte = false;
+            ack = isGroupMember(byte); //not our group, ignore the rest
+            continue;
+        }
+
+        if ( !hasCommand ) {
+            if ( commandKind(byte) == Command_Invalid ) {
+                if ( byte != 0x00 ) {
+                    invalid++; //0x00 ends the burst
+                }
+                ack = false;
+                continue;
+            }
+            command = byte;
+            hasCommand = true;
+            continue;
+        }
+
+        hasCommand = false;
+        uint8_t kind = commandKind(command);
+
+        if ( !validArgument(command, byte) ) {
+            invalid++;
+        } else if ( generalCall && kind != Command_Write ) {
+            invalid++;
+        } else if ( kind == Command_Register ) {
+            registerPointer = byte;
+            registerMode = true;
+        } else if ( kind == Command_Read ) {
+            readCommand = command;
+            readArgument = byte;
+            registerMode = false;
+        } else {
+            queue.push_back({ command, byte, first });
+            first = false;
+            highWater = std::max<uint8_t>(highWater, queue.size());
+            registerMode = false;
+        }
+
+        queueFull = (queue.size() >= queueSize);
+        ack = !queueFull;
+    }
+
+    return acknowledged; //unfinished pair is dropped by the stop
+}
+
+void SimulatedSlave::read(uint8_t *bytes, size_t count) {
+    bool released = false;
+
+    for ( size_t i=0; i<count; i++ ) {
+        if ( released ) {
+            bytes[i] = 0xFF; //slave has released the bus
+            continue;
+        }
+
+        bool more = false;
+        bytes[i] = answerByte(i, &more);
+        released = !more;
+    }
+}
+
+uint8_t SimulatedSlave::answerByte(uint8_t index, bool *more) {
+    if ( registerMode ) {
+        uint8_t reg = registerPointer + index;
+        *more = (reg+1 < I2C_REGISTERS_COUNT);
+
+        switch ( reg ) {
+            case Register_OutputMask: return currentMask & 0xFF;
+            case Register_InputLevels: return inputLevels;
+            case Register_InputEvents: return inputEventsCounter;
+            case Register_CommandsLow: return commandsCounter & 0xFF;
+            case Register_CommandsHigh: return commandsCounter >> 8;
+            case Register_PendingEvents: return events.size();
+            case Register_QueueSize: return queueSize;
+            case Register_QueueHighWater: return highWater;
+            case Register_RejectedFrames: return rejected;
+            case Register_ChainIndex: return chainIndex(slaveAddress);
+            default: return 0x00;
+        }
+    }
+
+    uint8_t value = 0x00;
+    *more = false;
+
+    switch ( readCommand ) {
+        case Command_GetPortValue:
+            value = (currentMask & ((Mask)1 << readArgument)) ? 0xFF : 0x00;
+            interruptLine = false;
+            break;
+
+        case Command_GetAllPortBits: {
+            uint8_t byte = readArgument + index;
+            value = (byte < outputBytes) ? (currentMask >> (byte*8)) & 0xFF : 0x00;
+            *more = (byte+1 < outputBytes);
+            interruptLine = false;
+            break;
+        }
+
+        case Command_GetEvents:
+            interruptLine = false;
+            if ( index == 0 ) {
+                eventsToSend = events.size();
+                value = eventsToSend | (eventsOverflowed ? 0x80 : 0x00);
+                eventsOverflowed = false;
+                *more = (eventsToSend > 0);
+                break;
+            }
+
+            switch ( (index-1) % 3 ) {
+                case 0:
+                    if ( !events.empty() ) {
+                        sendingEvent = events.front(); //event leaves the queue when its first byte is sent
+                        events.erase(events.begin());
+                    }
+                    value = sendingEvent.info;
+                    break;
+                case 1:
+                    value = sendingEvent.time & 0xFF;
+                    break;
+                default:
+                    value = sendingEvent.time >> 8;
+                    break;
+            }
+            *more = (index < eventsToSend*3);
+            break;
+
+        case Command_GetCounters:
+            interruptLine = false; //counters are not modelled
+            break;
+
+        case Command_GetGroups:
+            value = groups[index % I2C_GROUPS_COUNT];
+            *more = (index+1 < I2C_GROUPS_COUNT);
+            break;
+
+        default:
+            break;
+    }
+
+    return value;
+}
+
+void SimulatedSlave::process() {
+    for ( auto &queued : queue ) {
+        if ( queued.first ) {
+            maskBytePointer = 0x00; //see i2c_transactionStarted() in main.c
+        }
+        execute(queued.command, queued.argument);
+    }
+    queue.clear();
+}
+
+void SimulatedSlave::writeDone(Mask mask) {
+    commandsCounter++;
+
+    if ( stagingMode ) {
+        stagedMask = mask;
+        hasStagedMask = true;
+    } else {
+        currentMask = mask;
+    }
+}
+
+void SimulatedSlave::execute(uint8_t command, uint8_t argument) {
+    Mask bit = (argument > 0) ? (Mask)1 << (argument-1) : 0;
+
+    switch ( command ) {
+        case Command_SetPortValue: {
+            Mask port = (Mask)1 << ((argument & 0x0F)-1);
+            writeDone((argument & 0xF0) ? (baseMask() | port) : (baseMask() & ~port));
+            break;
+        }
+        case Command_SelectMaskByte:
+            maskBytePointer = argument;
+            break;
+        case Command_SetAllPortBits: {
+            uint8_t shift = maskBytePointer*8;
+            writeDone((baseMask() & ~((Mask)0xFF << shift)) | ((Mask)argument << shift));
+            maskBytePointer = (maskBytePointer+1) % outputBytes;
+            break;
+        }
+        case Command_TogglePortValue:
+            writeDone(baseMask() ^ bit);
+            break;
+        case Command_SwitchPortOn:
+        case Command_PulsePort: //timers are not modelled, the port stays on
+            writeDone(baseMask() | bit);
+            break;
+        case Command_SwitchPortOff:
+            writeDone(baseMask() & ~bit);
+            break;
+        case Command_AllSwitchOff:
+            writeDone(0);
+            break;
+        case Command_AllSwitchOn:
+            writeDone(allOutputs());
+            break;
+        case Command_StageCommands:
+            stagingMode = (argument != 0x00);
+            break;
+        case Command_CommitStaged: {
+            bool apply = hasStagedMask && argument == 0x00;
+            stagingMode = false;
+            hasStagedMask = false;
+            if ( apply ) {
+                writeDone(stagedMask);
+            }
+            break;
+        }
+        case Command_JoinGroup:
+            if ( !isGroupMember(argument) ) {
+                for ( uint8_t &slot : groups ) {
+                    if ( slot == 0x00 ) {
+                        slot = argument;
+                        return;
+                    }
+                }
+                invalid++; //no room
+            }
+            break;
+        case Command_LeaveGroup:
+            for ( uint8_t &slot : groups ) {
+                if ( argument == GROUP_ALL || slot == argument ) {
+                    slot = 0x00;
+                }
+            }
+            break;
+        default:
+            break; //scenes, rules and timers are kept by the firmware only
+    }
+}
+
+//an edge counts as a switch press, classified presses only go to the events queue
+void SimulatedSlave::press(uint8_t pin, bool pressed, uint8_t pressType) {
+    if ( events.size() >= 16 ) {
+        eventsOverflowed = true;
+    } else {
+        uint8_t info = (pin & 0x07) | (pressed ? 0x08 : 0x00) | ((pressType & 0x03) << 4);
+        events.push_back({ info, now });
+    }
+    now += 10;
+
+    if ( pressType == 0x00 ) {
+        inputEventsCounter++;
+    }
+    interruptLine = true;
+}
+
+/* ------------- bus ------------ */
+
+SimulatedSlave &SimulatedBus::add(uint8_t address, uint8_t outputBytes, uint8_t queueSize) {
+    slaves.emplace_back(new SimulatedSlave(address, outputBytes, queueSize));
+    return *slaves.back();
+}
+
+SimulatedSlave *SimulatedBus::find(uint8_t address) {
+    for ( auto &slave : slaves ) {
+        if ( slave->address() == address ) {
+            return slave.get();
+        }
+    }
+    return nullptr;
+}
+
+//the first message nobody acknowledges ends the transfer, as with I2C_RDWR
+size_t SimulatedBus::transfer(std::vector<Message> &batch) {
+    transfers++;
+    size_t sent = 0;
+
+    for ( auto &message : batch ) {
+        messages++;
+        bytes += 1 + message.data.size();
+
+        bool ok = true;
+        if ( message.address == GENERAL_CALL_ADDRESS && !message.read ) {
+            size_t acknowledged = 0; //wired-and, one member is enough
+            for ( auto &slave : slaves ) {
+                acknowledged = std::max(acknowledged, slave->write(message.data.data(), message.data.size(), true));
+            }
+            ok = (acknowledged == message.data.size());
+        } else {
+            SimulatedSlave *slave = find(message.address);
+            if ( !slave ) {
+                ok = false;
+            } else if ( message.read ) {
+                slave->read(message.data.data(), message.data.size());
+            } else {
+                ok = (slave->write(message.data.data(), message.data.size(), false) == message.data.size());
+            }
+        }
+
+        if ( !ok ) {
+            break;
+        }
+        sent++;
+    }
+
+    for ( auto &slave : slaves ) {
+        slave->process(); //main loops catch up before the next transfer
+    }
+    return (allOrNothing && sent < batch.size()) ? 0 : sent;
+}
+
+bool SimulatedBus::interruptRaised() {
+    for ( auto &slave : slaves ) {
+        if ( slave->interruptRaised() ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double SimulatedBus::busSeconds(double clockHz) const {
+    return (bytes*9 + messages + transfers) / clockHz;
+}
+
+}
@@ -0,0 +1,116 @@
+/* -------------------------------------
+	<sim_slave.h>
+	• boards of a chain as plain objects, no hardware needed
+	• the same protocol as i2c.c and main.c: bursts, queue, registers, read commands, groups
+	• a bus that counts transfers and bytes, for tests and benchmarks
+------------------------------------- */
+
+#ifndef SIM_SLAVE_H
+#define SIM_SLAVE_H
+
+#include "relaymatic.h"
+
+namespace relaymatic {
+
+/* SLAVE */
+// outputs, staging, groups, events and the register block are modelled,
+// other write commands are taken and counted, but do nothing
+class SimulatedSlave {
+public:
+    SimulatedSlave(uint8_t address, uint8_t outputBytes = 1, uint8_t queueSize = DEFAULT_QUEUE_SIZE);
+
+    uint8_t address() const { return slaveAddress; }
+
+    // bus side, as TWI_vect answers it, returns number of bytes acknowledged
+    size_t write(const uint8_t *bytes, size_t count, bool generalCall);
+    void read(uint8_t *bytes, size_t count); //ones after the answer is over
+
+    // main loop, runs queued write commands
+    void process();
+
+    // board side
+    void press(uint8_t pin, bool pressed = true, uint8_t pressType = 0x00); //switch event, raises the interrupt line
+    void setInputLevels(uint8_t levels) { inputLevels = levels; }
+    void raiseInterrupt() { interruptLine = true; }
+
+    Mask outputs() const { return currentMask; }
+    bool interruptRaised() const { return interruptLine; }
+    bool staging() const { return stagingMode; }
+    uint16_t executedCommands() const { return commandsCounter; }
+    uint8_t rejectedFrames() const { return rejected; }
+    uint8_t invalidCommands() const { return invalid; }
+
+private:
+    uint8_t slaveAddress;
+    uint8_t outputBytes;
+    uint8_t queueSize;
+
+    struct QueuedCommand { uint8_t command; uint8_t argument; bool first; };
+    std::vector<QueuedCommand> queue; //write commands waiting for the main loop
+    uint8_t highWater = 0;
+    uint8_t rejected = 0;
+    uint8_t invalid = 0;
+
+    // read commands and registers
+    uint8_t readCommand = 0x00, readArgument = 0x00;
+    bool registerMode = false;
+    uint8_t registerPointer = 0x00;
+
+    // state behind the commands
+    Mask currentMask = 0;
+    Mask stagedMask = 0;
+    bool stagingMode = false, hasStagedMask = false;
+    uint8_t maskBytePointer = 0x00;
+    uint8_t groups[4] = {};
+    uint16_t commandsCounter = 0;
+
+    struct QueuedEvent { uint8_t info; uint16_t time; };
+    std::vector<QueuedEvent> events;
+    QueuedEvent sendingEvent = {};
+    uint8_t eventsToSend = 0; //never more than announced in the header
+    bool eventsOverflowed = false;
+    uint8_t inputEventsCounter = 0;
+    uint8_t inputLevels = 0xFF;
+    uint16_t now = 0;
+    bool interruptLine = false;
+
+    bool validArgument(uint8_t command, uint8_t argument) const;
+    bool isGroupMember(uint8_t group) const;
+    void execute(uint8_t command, uint8_t argument);
+    void writeDone(Mask mask);
+    Mask baseMask() const { return (stagingMode && hasStagedMask) ? stagedMask : currentMask; }
+    Mask allOutputs() const { return (outputBytes < 8) ? (((Mask)1 << (outputBytes*8)) - 1) : ~(Mask)0; }
+    uint8_t answerByte(uint8_t index, bool *more);
+};
+
+/* BUS */
+// slaves answer in the order messages come, the main loop of every slave runs after each transfer
+class SimulatedBus : public Bus {
+public:
+    SimulatedSlave &add(uint8_t address, uint8_t outputBytes = 1, uint8_t queueSize = DEFAULT_QUEUE_SIZE);
+    SimulatedSlave *find(uint8_t address);
+
+    size_t transfer(std::vector<Message> &messages) override;
+    bool reportsProgress() const override { return !allOrNothing; }
+
+    bool hasInterruptLine() const override { return true; }
+    bool interruptRaised() override;
+
+    // a failed transfer returns 0, as a linux adapter does, whatever went through before the error
+    bool allOrNothing = false;
+
+    // statistics
+    unsigned long transfers = 0;
+    unsigned long messages = 0;
+    unsigned long bytes = 0; //address bytes included
+
+    // time the bus would take at the given clock, 9 bits a byte, start and stop conditions
+    double busSeconds(double clockHz = 100000) const;
+
+private:
+    std::vector<std::unique_ptr<SimulatedSlave>> slaves;
+};
+
+}
+
+#endif
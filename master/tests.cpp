@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+extern "C" {
+#include "sim.h"
+#include "interface.h"
+
+void run_pending_tasks();
+}
+
+#include "relaymatic.h"
+#include "sim_slave.h"
+
+using namespace relaymatic;
+
+// the firmware from host/sim.c as the only board on the bus
+class FirmwareBus : public Bus {
+public:
+    size_t transfer(std::vector<Message> &messages) override {
+        size_t sent = 0;
+
+        for ( auto &message : messages ) {
+            uint8_t count = message.data.size();
+            bool ok = true;
+
+            if ( message.address == GENERAL_CALL_ADDRESS ) {
+                ok = (sim_twiGeneralCall(message.data.data(), count) == count);
+            } else if ( message.address != (TWAR >> 1) ) {
+                ok = false; //nobody answers
+            } else if ( message.read ) {
+                sim_twiRead(message.data.data(), count);
+            } else {
+                ok = (sim_twiWrite(message.data.data(), count) == count);
+            }
+
+            if ( !ok ) {
+                break;
+            }
+            sent++;
+        }
+
+        run_pending_tasks(); //main loop
+        sim_spi();
+        return sent;
+    }
+    bool reportsProgress() const override { return true; }
+
+    bool hasInterruptLine() const override { return true; }
+    bool interruptRaised() override { return (PORTC & INTERRUPT_LINE) != 0; }
+};
+
+/* ------------- writes ------------ */
+
+void test_changesAreCoalesced() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    for ( uint8_t i=0; i<3; i++ ) {
+        bus.add(chainAddress(i));
+        chain.addChainIndex(i);
+    }
+
+    chain.board(0).set(1, true);
+    chain.board(0).set(1, false);
+    chain.board(0).toggle(3);
+    chain.board(1).setOutputs(0xA5);
+    chain.board(1).toggle(1);
+    chain.board(2).set(8, true);
+    CHECK(chain.board(1).outputs() == 0xA4);
+
+    CHECK(chain.flush());
+    CHECK(bus.transfers == 1 && bus.messages == 3); //one burst for every board
+    CHECK(bus.find(chainAddress(0))->outputs() == 0x04);
+    CHECK(bus.find(chainAddress(1))->outputs() == 0xA4);
+    CHECK(bus.find(chainAddress(2))->outputs() == 0x80);
+
+    CHECK(bus.find(chainAddress(0))->executedCommands() == 1); //first port went on and off in the cache only
+    CHECK(bus.find(chainAddress(1))->executedCommands() == 1); //one mask byte instead of 4 ports
+
+    CHECK(chain.flush()); //nothing left
+    CHECK(bus.transfers == 1);
+    CHECK(chain.board(1).confirmedOutputs() == 0xA4);
+}
+
+void test_burstsFitTheQueue() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    SimulatedSlave &slave = bus.add(0x70, 1, 4);
+    Board &board = chain.add(0x70);
+
+    CHECK(chain.refresh());
+    CHECK(board.queueSize() == 4);
+
+    for ( uint8_t i=0; i<10; i++ ) {
+        board.command(Command_TogglePortValue, 1);
+    }
+    CHECK(chain.flush());
+    CHECK(bus.transfers == 1+3); //refresh, then 4+4+2 pairs
+    CHECK(slave.rejectedFrames() == 0);
+    CHECK(slave.executedCommands() == 10 && slave.outputs() == 0x00);
+}
+
+void test_wideBoards() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    SimulatedSlave &slave = bus.add(0x70, 4);
+    Board &board = chain.add(0x70, 4);
+
+    board.set(2, true);
+    board.set(30, true);
+    CHECK(chain.flush());
+    CHECK(slave.outputs() == (((Mask)1 << 29) | 0x02));
+    CHECK(slave.executedCommands() == 2); //two ports are shorter than 'B' and four bytes
+
+    board.setOutputs(0x00FFFF00);
+    CHECK(chain.flush());
+    CHECK(slave.outputs() == 0x00FFFF00);
+
+    CHECK(chain.refresh());
+    CHECK(board.confirmedOutputs() == 0x00FFFF00); //register block has only the first byte
+    CHECK(bus.transfers == 2+2);
+}
+
+void test_maskBytePointerPerTransaction() {
+    SimulatedBus bus;
+    SimulatedSlave &slave = bus.add(0x70, 4);
+
+    std::vector<Message> messages = {
+        { 0x70, false, { Command_SelectMaskByte, 0x01, Command_SetAllPortBits, 0x11 } },
+        { 0x70, false, { Command_SetAllPortBits, 0x22 } }, //repeated start, 'S' goes to the first byte again
+    };
+    CHECK(bus.transfer(messages) == 2);
+    CHECK(slave.outputs() == 0x1122);
+}
+
+void test_offlineBoardDoesNotHoldOthers() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    bus.add(0x70);
+    bus.add(0x72);
+    chain.add(0x70);
+    chain.add(0x71); //not plugged in
+    chain.add(0x72);
+
+    for ( size_t i=0; i<chain.size(); i++ ) {
+        chain.board(i).set(1, true);
+    }
+    CHECK(!chain.flush());
+    CHECK(!chain.board(1).online() && chain.board(0).online() && chain.board(2).online());
+    CHECK(bus.find(0x70)->outputs() == 0x01 && bus.find(0x72)->outputs() == 0x01);
+    CHECK(chain.board(1).hasPendingWrites()); //output change stays for the next flush
+
+    unsigned long transfers = bus.transfers;
+    chain.board(0).set(2, true);
+    chain.board(2).set(2, true);
+    CHECK(!chain.flush());
+    CHECK(bus.transfers - transfers == 2); //the others together, the offline one alone
+    CHECK(bus.find(0x72)->outputs() == 0x03);
+}
+
+void test_takenPartsAreNotRepeated() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    SimulatedSlave &slave = bus.add(0x40);
+    chain.add(0x40).command(Command_TogglePortValue, 1);
+    chain.add(0x41).set(1, true); //not plugged in
+
+    CHECK(!chain.flush());
+    CHECK(slave.executedCommands() == 1 && slave.outputs() == 0x01);
+    CHECK(chain.board(0).online() && !chain.board(1).online());
+    CHECK(bus.transfers == 1); //nothing was left after the refusing board
+}
+
+void test_allOrNothingBus() {
+    SimulatedBus bus;
+    bus.allOrNothing = true;
+    Chain chain(bus);
+    SimulatedSlave &slave = bus.add(0x40);
+    bus.add(0x42);
+    chain.add(0x40).command(Command_TogglePortValue, 1);
+    chain.add(0x41).set(1, true); //not plugged in
+    chain.add(0x42).set(2, true);
+
+    CHECK(!chain.flush());
+    CHECK(slave.executedCommands() == 1 && slave.outputs() == 0x01); //the toggle went alone, once
+    CHECK(bus.find(0x42)->outputs() == 0x02);
+    CHECK(chain.board(0).online() && !chain.board(1).online() && chain.board(2).online());
+
+    slave.press(3);
+    CHECK(!chain.refresh()); //0x41 is still not there
+    CHECK(!chain.refresh());
+    std::vector<Event> events = chain.board(0).takeEvents();
+    CHECK(events.size() == 1 && events[0].pin == 3);
+}
+
+void test_flushTogether() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    for ( uint8_t i=0; i<3; i++ ) {
+        bus.add(chainAddress(i));
+        chain.addChainIndex(i).command(Command_JoinGroup, 5);
+    }
+    CHECK(chain.flush());
+
+    chain.board(0).set(1, true);
+    chain.board(2).setOutputs(0xF0);
+    CHECK(chain.flushTogether(5));
+    CHECK(bus.find(chainAddress(0))->outputs() == 0x01);
+    CHECK(bus.find(chainAddress(2))->outputs() == 0xF0);
+    CHECK(!bus.find(chainAddress(0))->staging() && !bus.find(chainAddress(2))->staging());
+}
+
+/* ------------- polls ------------ */
+
+void test_pollsArePipelined() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    for ( uint8_t i=0; i<12; i++ ) {
+        bus.add(chainAddress(i));
+        chain.addChainIndex(i);
+    }
+
+    CHECK(chain.refresh());
+    CHECK(bus.transfers == 1); //24 messages fit into one transfer, masks are in the registers
+    CHECK(chain.board(9).chainIndex() == 9);
+    CHECK(chain.board(9).queueSize() == DEFAULT_QUEUE_SIZE);
+
+    chain.board(3).command(Command_AllSwitchOn, 0x00);
+    CHECK(chain.flush());
+    CHECK(chain.refresh());
+    CHECK(bus.transfers == 1+1+1); //register blocks only, the line is low
+    CHECK(chain.board(3).outputs() == 0xFF);
+}
+
+void test_interruptLineRefresh() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    bus.add(0x70);
+    SimulatedSlave &slave = bus.add(0x71);
+    chain.add(0x70);
+    Board &board = chain.add(0x71);
+    CHECK(chain.refresh());
+
+    unsigned long transfers = bus.transfers;
+    CHECK(chain.service());
+    CHECK(bus.transfers == transfers); //line is low, nothing to do
+
+    slave.press(3);
+    slave.press(3, false);
+    CHECK(bus.interruptRaised());
+    CHECK(chain.service());
+    CHECK(!bus.interruptRaised()); //reading events releases it
+
+    std::vector<Event> events = board.takeEvents();
+    CHECK(events.size() == 2);
+    CHECK(events[0].pin == 3 && events[0].pressed && events[0].pressType == 0x00);
+    CHECK(!events[1].pressed && events[1].time > events[0].time);
+    CHECK(board.takeEvents().empty());
+}
+
+void test_discoverHotPluggedBoard() {
+    SimulatedBus bus;
+    Chain chain(bus);
+    bus.add(chainAddress(0));
+    chain.addChainIndex(0);
+    CHECK(chain.refresh());
+
+    bus.add(chainAddress(9)).raiseInterrupt(); //has got its address from the chain
+    CHECK(chain.service());
+    CHECK(chain.size() == 2 && chain.find(chainAddress(9)));
+    CHECK(chain.find(chainAddress(9))->chainIndex() == 9);
+    CHECK(!bus.interruptRaised());
+}
+
+/* ------------- against the firmware ------------ */
+
+void test_firmwareTakesCoalescedWrites() {
+    FirmwareBus bus;
+    Chain chain(bus);
+    Board &board = chain.add(0x70);
+    CHECK(chain.refresh());
+    CHECK(chain.refresh()); //the first one came before the main loop filled the registers
+    CHECK(board.queueSize() == 16 && board.chainIndex() == 0xFF); //default address, never enumerated
+
+    board.setOutputs(0x3C);
+    board.toggle(8);
+    CHECK(chain.flush());
+    CHECK(chain.refresh());
+    CHECK(board.confirmedOutputs() == 0xBC);
+
+    board.set(3, false);
+    CHECK(chain.flush());
+    CHECK(chain.refresh());
+    CHECK(board.confirmedOutputs() == 0xB8);
+    CHECK(board.executedCommands() == 2);
+}
+
+void test_firmwareEventsReleaseLine() {
+    FirmwareBus bus;
+    Chain chain(bus);
+    Board &board = chain.add(0x70);
+    CHECK(chain.refresh());
+
+    sim_setInputs(0xFF & ~_BV(4));
+    sim_ticks(10);
+    run_pending_tasks();
+    CHECK(bus.interruptRaised());
+
+    CHECK(chain.service());
+    CHECK(!bus.interruptRaised());
+    CHECK(board.outputs() == _BV(4)); //toggled on the board, the cache follows
+
+    std::vector<Event> events = board.takeEvents();
+    CHECK(events.size() == 1 && events[0].pin == 4 && events[0].pressed);
+}
+
+void test_firmwareFlushTogether() {
+    FirmwareBus bus;
+    Chain chain(bus);
+    Board &board = chain.add(0x70);
+    board.command(Command_JoinGroup, 7);
+    CHECK(chain.flush());
+
+    board.setOutputs(0x81);
+    CHECK(chain.flushTogether(7));
+    CHECK(chain.refresh());
+    CHECK(board.confirmedOutputs() == 0x81);
+}
+
+/* ---------------------------------------- */
+
+typedef void (*TestFunction)();
+
+// every test runs in its own process, so firmware starts from the power-up state
+int run(const char *name, TestFunction test) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+        sim_reset();
+        test();
+        fflush(stdout);
+        _exit(sim_failures != 0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    bool passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("%s %s\n", passed ? "PASS" : "FAIL", name);
+
+    return passed ? 0 : 1;
+}
+
+#define RUN(test) failed += run(#test, test)
+
+int main() {
+    int failed = 0;
+
+    RUN(test_changesAreCoalesced);
+    RUN(test_burstsFitTheQueue);
+    RUN(test_wideBoards);
+    RUN(test_maskBytePointerPerTransaction);
+    RUN(test_offlineBoardDoesNotHoldOthers);
+    RUN(test_takenPartsAreNotRepeated);
+    RUN(test_allOrNothingBus);
+    RUN(test_flushTogether);
+    RUN(test_pollsArePipelined);
+    RUN(test_interruptLineRefresh);
+    RUN(test_discoverHotPluggedBoard);
+    RUN(test_firmwareTakesCoalescedWrites);
+    RUN(test_firmwareEventsReleaseLine);
+    RUN(test_firmwareFlushTogether);
+
+    printf("%d failed\n", failed);
+    return failed != 0;
+}
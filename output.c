@@ -1,14 +1,25 @@
 #include <avr/io.h>
-#include <avr/wdt.h>
-#include <util/delay.h>
+#include <avr/interrupt.h>
 #include <stdlib.h> 
 #include <stdbool.h>
 
 #include "output.h"
+#include "dispatch.h"
+#include "counters.h"
 
-volatile uint8_t _currentStateMask = 0x00;
+volatile OutputMask _currentStateMask = 0x00;
 volatile bool hasNewOutput = true;
 
+// staggered sequence, one relay per slot
+static volatile OutputMask sequenceTargetMask = 0x00;
+static volatile bool sequenceActive = false;
+static uint8_t sequenceSlotTicks = 0;
+
+// shadow copy of the mask being shifted out, the published one can change meanwhile
+static uint8_t shiftBuffer[OUTPUT_BYTES];
+static volatile uint8_t shiftPosition = 0; //bytes still to go after the one on the wire
+static volatile bool shifting = false;
+
 // basic IO setup
 void init_output_ports() {
     //shift register on SPI lines
@@ -16,56 +27,137 @@ void init_output_ports() {
     PORTB &= ~(DATA_PIN | LATCH_PIN | CLOCK_PIN);  //set them to low
     PORTB |= OE_PIN; //output enable (active low = disabled)
 
-    //enable SPI master mode for 595 shift register
+    //enable SPI master mode for 595 shift registers, fosc/2, interrupt is on while shifting
     SPCR = (1<<SPE) | (1<<MSTR); 
+    SPSR |= (1<<SPI2X);
+
+    dispatch_post(Task_Output); //shift out the initial state
 }
 
-// fastest mode — store the new value and use it in the next loop iteration
-void setOutputStateMask(uint8_t mask) {
+// fastest mode — store the new value and use it in the next loop iteration
+void setOutputStateMask(OutputMask mask) {
+    uint8_t sreg = SREG; //can be called from interrupts too
+    cli();
+    sequenceActive = false; //newer command wins over a running sequence
     _currentStateMask = mask;
     hasNewOutput = true;
+    dispatch_post(Task_Output);
+    SREG = sreg;
+}
+
+// switch some outputs off right away, a running sequence keeps going without them
+void clearOutputStateBits(OutputMask bits) {
+    uint8_t sreg = SREG; //called from the tick interrupt by timers
+    cli();
+    _currentStateMask &= ~bits;
+    sequenceTargetMask &= ~bits;
+    hasNewOutput = true;
+    dispatch_post(Task_Output);
+    SREG = sreg;
 }
 
-// slowest mode – the same as above, but in delayed sequence
-void setOutputStateMaskSlowly(uint8_t newMask) {
-	for ( int i=0; i<8; i++ ) {
-		if (   (_BV(i) & _currentStateMask) 
-			!= (_BV(i) & newMask) )
-		{	
-			_currentStateMask ^= _BV(i);
-			hasNewOutput = true;
-
-		    process_output(); //push to 595 register
-
-		    _delay_ms(42); //pause between each relay toggling
-		    wdt_reset(); //keep the dog happy after each delay
-		}
-	}
+// slowest mode – the same as above, but in timed sequence, returns right away
+void setOutputStateMaskSlowly(OutputMask newMask) {
+    uint8_t sreg = SREG;
+    cli();
+    if ( !sequenceActive ) {
+        sequenceSlotTicks = OUTPUT_SEQUENCE_SLOT_TICKS-1; //first relay goes on the next tick
+    }
+    sequenceTargetMask = newMask; //running sequence just heads to the new target
+    sequenceActive = true;
+    SREG = sreg;
 }
 
-// main loop processing
-void process_output() {
-    if ( hasNewOutput ) {    
-        PORTB &= ~LATCH_PIN; //pull latch low 
+// called on every system tick, toggles one relay per slot
+void output_tick() {
+    if ( !sequenceActive || ++sequenceSlotTicks < OUTPUT_SEQUENCE_SLOT_TICKS ) {
+        return;
+    }
+    sequenceSlotTicks = 0;
+
+    OutputMask diff = _currentStateMask ^ sequenceTargetMask;
+    if ( diff == 0x00 ) {
+        sequenceActive = false; //sequence is over
+        return;
+    }
+
+    _currentStateMask ^= (diff & -diff); //lowest different relay first
+    hasNewOutput = true;
+    dispatch_post(Task_Output);
+}
+
+// is there a sequence running
+bool output_sequenceActive() {
+    return sequenceActive;
+}
+
+// take the published mask and put its first byte on the wire, interrupts have to be disabled
+static void output_startShift() {
+    OutputMask mask = _currentStateMask;
+    hasNewOutput = false; //a change during the shift starts the next one
+
+    for ( uint8_t i=0; i<OUTPUT_BYTES; i++ ) {
+        shiftBuffer[i] = OUTPUT_BYTE(mask, i);
+    }
 
-        SPDR = _currentStateMask;  //shift in some data
-        while(!(SPSR & (1<<SPIF)));  //wait for SPI process to finish
+    //the farthest register in the chain goes first, outputs 1-8 are the last byte
+    shiftPosition = OUTPUT_BYTES-1;
+    shifting = true;
+    SPCR |= (1<<SPIE);
+    SPDR = shiftBuffer[OUTPUT_BYTES-1];
+}
+
+// one byte is out, send the next one or latch the whole chain
+ISR(SPI_STC_vect) {
+    counters_increment(Counter_SPI_STC);
 
-        PORTB |= LATCH_PIN; //pull latch high
-        PORTB &= ~LATCH_PIN; //and then low again
+    if ( shiftPosition > 0 ) {
+        SPDR = shiftBuffer[--shiftPosition];
+        return;
+    }
 
-        PORTB &= ~OE_PIN; //enable output, if it's been disabled
+    PORTB |= LATCH_PIN; //pull latch high
+    PORTB &= ~LATCH_PIN; //and then low again
+    PORTB &= ~OE_PIN; //enable output, if it's been disabled
 
-        hasNewOutput = false;
+    if ( hasNewOutput ) {
+        output_startShift(); //mask was changed while we were shifting
+    } else {
+        SPCR &= ~(1<<SPIE);
+        shifting = false;
     }
 }
 
+// main loop processing, just starts the shift, interrupt does the rest
+void process_output() {
+    uint8_t sreg = SREG;
+    cli();
+    if ( hasNewOutput && !shifting ) {
+        output_startShift();
+    }
+    SREG = sreg;
+}
+
+// is a shift in progress, SPI clock stops in power down
+bool output_busy() {
+    return shifting;
+}
+
 // tell main loop that we have something to do again
 bool output_hasNewState() {
 	return hasNewOutput;
 }
 
 // public method to give everyone access to the current relay state
-volatile uint8_t __attribute__ ((noinline)) currentOutputStateMask() {
-	return (_currentStateMask&0xFF);
-}
\ No newline at end of file
+OutputMask currentOutputStateMask() {
+#if OUTPUT_BYTES == 1
+    return _currentStateMask; //single byte, always consistent
+#else
+    uint8_t sreg = SREG;
+    cli();
+    OutputMask mask = _currentStateMask;
+    SREG = sreg;
+
+    return mask;
+#endif
+}
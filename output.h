@@ -1,9 +1,35 @@
 /* ------------------------------------- 
 	<output.h>
-	• output state to 595 shift register (leds+relays)
+	• output state to a chain of 595 shift registers (leds+relays)
+	• shift out from a shadow copy in SPI interrupt, latch when the chain is full
 	• maintain relays state
+	• switch relays one by one in a timed sequence
 ------------------------------------- */
 
+#define OUTPUT_SEQUENCE_SLOT_TICKS  4 //system ticks between two relays in a sequence
+
+/* WIDTH */
+#ifndef OUTPUT_BYTES
+    #define OUTPUT_BYTES    1 //595 registers in a chain: 1, 2 or 4 (EEPROM holds no more)
+#endif
+
+#define OUTPUT_COUNT    (OUTPUT_BYTES*8)
+
+// one bit for every output, output 1 is the lsb
+#if OUTPUT_BYTES == 1
+    typedef uint8_t OutputMask;
+#elif OUTPUT_BYTES == 2
+    typedef uint16_t OutputMask;
+#elif OUTPUT_BYTES == 4
+    typedef uint32_t OutputMask;
+#else
+    #error "OUTPUT_BYTES has to be 1, 2 or 4"
+#endif
+
+#define OUTPUT_BIT(number)      ((OutputMask)1 << (number)) //zero based
+#define OUTPUT_ALL              ((OutputMask)~(OutputMask)0)
+#define OUTPUT_BYTE(mask, n)    ((uint8_t)((mask) >> ((n)*8))) //n-th byte, lsb first
+
 /* PINS */
 //all pins for 595 shift register (SPI)
 #define DATA_PIN (1<<PB3)           //=MOSI, =SER
@@ -11,20 +37,33 @@
 #define CLOCK_PIN (1<<PB5)          //=SCK, =SRCLK
 #define OE_PIN (1<<PB1)         	//=OE
 
+/* INTERRUPTS */
+ISR(SPI_STC_vect); //next byte of the chain, latch after the last one
+
 /* FUNCTIONS */
 void init_output_ports(); //basic setup
 void process_output(); //loop processing
+void output_tick(); //call on every system tick
 
 // check whether any new bits were changed
 bool output_hasNewState(); 
 
 // get current state
-volatile uint8_t currentOutputStateMask(); 
+OutputMask currentOutputStateMask(); 
 
 // fast method
-void setOutputStateMask(uint8_t byte);
+void setOutputStateMask(OutputMask mask);
+
+// switch some outputs off, unlike the above a running sequence is not cancelled
+void clearOutputStateBits(OutputMask bits);
+
+// the sames as above, but in sequence and with delays, does not block
+void setOutputStateMaskSlowly(OutputMask newMask); 
+
+// is there a sequence running
+bool output_sequenceActive();
 
-// the sames as above, but in sequence and with delays
-void setOutputStateMaskSlowly(uint8_t newMask); 
+// is a shift in progress
+bool output_busy();
 
 
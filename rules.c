@@ -0,0 +1,100 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <stdlib.h> 
+#include <stdbool.h> 
+
+#include "output.h"
+#include "rules.h"
+#include "counters.h"
+
+// every record: action, argument and output bytes (lsb first)
+enum {
+    RuleRecord_Action = 0,
+    RuleRecord_Argument,
+    RuleRecord_Outputs,
+};
+
+static uint8_t rulesEeprom[RULES_COUNT][RULE_RECORD_SIZE] EEMEM;
+
+// cache, tick interrupt reads it while the main loop may change a rule
+static volatile Rule cache[RULES_COUNT];
+static uint32_t dirtyRules = 0x00; //bit for every rule to be written
+
+void init_rules() {
+    uint8_t record[RULE_RECORD_SIZE];
+
+    for ( uint8_t index=0; index<RULES_COUNT; index++ ) {
+        eeprom_read_block(record, rulesEeprom[index], RULE_RECORD_SIZE);
+
+        OutputMask outputs = 0x00;
+        for ( uint8_t i=0; i<OUTPUT_BYTES; i++ ) {
+            outputs |= (OutputMask)record[RuleRecord_Outputs+i] << (i*8);
+        }
+
+        uint8_t action = record[RuleRecord_Action];
+        cache[index].action = (action < RULE_ACTIONS_COUNT) ? action : Rule_Default;
+        cache[index].argument = record[RuleRecord_Argument];
+        cache[index].outputs = outputs;
+    }
+    dirtyRules = 0x00;
+}
+
+void rules_get(uint8_t index, Rule *rule) {
+    uint8_t sreg = SREG;
+    cli();
+    rule->action = cache[index].action;
+    rule->argument = cache[index].argument;
+    rule->outputs = cache[index].outputs;
+    SREG = sreg;
+}
+
+void rules_set(uint8_t index, const Rule *rule) {
+    if ( index >= RULES_COUNT ) {
+        return;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    cache[index].action = (rule->action < RULE_ACTIONS_COUNT) ? rule->action : Rule_Default;
+    cache[index].argument = rule->argument;
+    cache[index].outputs = rule->outputs;
+    SREG = sreg;
+
+    dirtyRules |= ((uint32_t)1 << index);
+}
+
+bool rules_needSaving() {
+    return (dirtyRules != 0x00);
+}
+
+void rules_save() {
+    uint8_t record[RULE_RECORD_SIZE];
+
+    for ( uint8_t index=0; index<RULES_COUNT; index++ ) {
+        if ( (dirtyRules & ((uint32_t)1 << index)) == 0 ) {
+            continue;
+        }
+        dirtyRules &= ~((uint32_t)1 << index);
+
+        Rule rule;
+        rules_get(index, &rule);
+        record[RuleRecord_Action] = rule.action;
+        record[RuleRecord_Argument] = rule.argument;
+        for ( uint8_t i=0; i<OUTPUT_BYTES; i++ ) {
+            record[RuleRecord_Outputs+i] = OUTPUT_BYTE(rule.outputs, i);
+        }
+
+        for ( uint8_t i=0; i<RULE_RECORD_SIZE; i++ ) {
+            if ( eeprom_read_byte(&rulesEeprom[index][i]) == record[i] ) {
+                continue; //eeprom wears out on writes only
+            }
+            eeprom_write_byte(&rulesEeprom[index][i], record[i]);
+
+            uint8_t sreg = SREG;
+            cli();
+            counters_increment(Counter_EepromWrites);
+            SREG = sreg;
+        }
+    }
+}
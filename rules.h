@@ -0,0 +1,45 @@
+/* ------------------------------------- 
+	<rules.h>
+	• local switch-to-relay rules, one for every input and press type
+	• rules are stored in EEPROM and cached in RAM
+	• lookup is a plain table index, so rules can run inside the tick interrupt
+------------------------------------- */
+
+#define RULES_INPUTS        8 //switch lines
+#define RULES_COUNT         (RULES_INPUTS*4) //every press type, see InputPressTypes
+
+#define RULE_INDEX(input, pressType)    (((input) << 2) | (pressType))
+#define RULE_RECORD_SIZE    (OUTPUT_BYTES+2) //action, argument and outputs
+
+enum RuleActions {
+    Rule_Default = 0x00, //edge toggles the relay with the same number, other presses do nothing
+    Rule_None, //nothing, e.g. to leave the edge alone and act on a classified press
+    Rule_Toggle, //toggle all outputs of the rule
+    Rule_On,
+    Rule_Off,
+    Rule_Scene, //recall a scene, argument is the slot
+    Rule_Pulse, //outputs on, then off, argument is the length, see TIMER_LENGTH()
+
+    RULE_ACTIONS_COUNT //anything else (e.g. erased eeprom) is Rule_Default
+};
+
+typedef struct {
+    uint8_t action;
+    uint8_t argument;
+    OutputMask outputs;
+} Rule;
+
+/* FUNCTIONS */
+void init_rules(); //fill the cache from eeprom
+
+// rule from the cache, safe to call from interrupts
+void rules_get(uint8_t index, Rule *rule);
+
+// replace a rule in the cache, eeprom is written by rules_save()
+void rules_set(uint8_t index, const Rule *rule);
+
+// are there rules not written to eeprom yet
+bool rules_needSaving();
+
+// write changed rules to eeprom, blocks for every byte, journal must not be writing
+void rules_save();
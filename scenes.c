@@ -0,0 +1,121 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <stdlib.h> 
+#include <stdbool.h> 
+
+#include "output.h"
+#include "scenes.h"
+#include "counters.h"
+
+// every record: mask bytes, sequenced channels bytes (both lsb first) and checksum
+enum {
+    Scene_Mask = 0,
+    Scene_Sequenced = OUTPUT_BYTES,
+    Scene_Checksum = OUTPUT_BYTES*2,
+};
+
+static uint8_t scenesEeprom[SCENES_COUNT][SCENE_RECORD_SIZE] EEMEM;
+
+// cache, TWI interrupt reads it while the main loop may store a new scene
+typedef struct {
+    OutputMask mask;
+    OutputMask sequenced;
+    bool valid;
+} Scene;
+
+static volatile Scene cache[SCENES_COUNT];
+static uint8_t dirtySlots = 0x00; //bit for every slot to be written
+
+// both erased (0xFF) and zeroed records are invalid, there is always an even number of bytes
+static uint8_t scenes_checksum(const uint8_t *record) {
+    uint8_t checksum = 0xA5;
+    for ( uint8_t i=0; i<Scene_Checksum; i++ ) {
+        checksum ^= record[i];
+    }
+    return checksum;
+}
+
+void init_scenes() {
+    uint8_t record[SCENE_RECORD_SIZE];
+
+    for ( uint8_t slot=0; slot<SCENES_COUNT; slot++ ) {
+        eeprom_read_block(record, scenesEeprom[slot], SCENE_RECORD_SIZE);
+
+        OutputMask mask = 0x00, sequenced = 0x00;
+        for ( uint8_t i=0; i<OUTPUT_BYTES; i++ ) {
+            mask |= (OutputMask)record[Scene_Mask+i] << (i*8);
+            sequenced |= (OutputMask)record[Scene_Sequenced+i] << (i*8);
+        }
+
+        cache[slot].mask = mask;
+        cache[slot].sequenced = sequenced;
+        cache[slot].valid = (record[Scene_Checksum] == scenes_checksum(record));
+    }
+    dirtySlots = 0x00;
+}
+
+bool scenes_get(uint8_t slot, OutputMask *mask, OutputMask *sequenced) {
+    if ( slot >= SCENES_COUNT ) {
+        return false;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    *mask = cache[slot].mask;
+    *sequenced = cache[slot].sequenced;
+    bool valid = cache[slot].valid;
+    SREG = sreg;
+
+    return valid;
+}
+
+void scenes_store(uint8_t slot, OutputMask mask, OutputMask sequenced) {
+    if ( slot >= SCENES_COUNT ) {
+        return;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    cache[slot].mask = mask;
+    cache[slot].sequenced = sequenced;
+    cache[slot].valid = true;
+    SREG = sreg;
+
+    dirtySlots |= _BV(slot);
+}
+
+bool scenes_needSaving() {
+    return (dirtySlots != 0x00);
+}
+
+void scenes_save() {
+    uint8_t record[SCENE_RECORD_SIZE];
+
+    for ( uint8_t slot=0; slot<SCENES_COUNT; slot++ ) {
+        if ( (dirtySlots & _BV(slot)) == 0 ) {
+            continue;
+        }
+        dirtySlots &= ~_BV(slot);
+
+        OutputMask mask, sequenced;
+        scenes_get(slot, &mask, &sequenced);
+        for ( uint8_t i=0; i<OUTPUT_BYTES; i++ ) {
+            record[Scene_Mask+i] = OUTPUT_BYTE(mask, i);
+            record[Scene_Sequenced+i] = OUTPUT_BYTE(sequenced, i);
+        }
+        record[Scene_Checksum] = scenes_checksum(record);
+
+        for ( uint8_t i=0; i<SCENE_RECORD_SIZE; i++ ) {
+            if ( eeprom_read_byte(&scenesEeprom[slot][i]) == record[i] ) {
+                continue; //eeprom wears out on writes only
+            }
+            eeprom_write_byte(&scenesEeprom[slot][i], record[i]);
+
+            uint8_t sreg = SREG;
+            cli();
+            counters_increment(Counter_EepromWrites);
+            SREG = sreg;
+        }
+    }
+}
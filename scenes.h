@@ -0,0 +1,31 @@
+/* ------------------------------------- 
+	<scenes.h>
+	• scene slots in EEPROM: output mask and channels to switch in sequence
+	• all slots are cached in RAM, recall never reads EEPROM
+	• slots are written to EEPROM by the main loop, only changed bytes
+------------------------------------- */
+
+#ifndef SCENES_COUNT
+    #define SCENES_COUNT    8 //slots, up to 8
+#endif
+
+#if SCENES_COUNT > 8
+    #error "SCENES_COUNT has to be up to 8"
+#endif
+
+#define SCENE_RECORD_SIZE   (OUTPUT_BYTES*2+1) //mask, sequenced channels and checksum
+
+/* FUNCTIONS */
+void init_scenes(); //fill the cache from eeprom
+
+// scene from the cache, returns false for an empty slot
+bool scenes_get(uint8_t slot, OutputMask *mask, OutputMask *sequenced);
+
+// replace a slot in the cache, eeprom is written by scenes_save()
+void scenes_store(uint8_t slot, OutputMask mask, OutputMask sequenced);
+
+// are there slots not written to eeprom yet
+bool scenes_needSaving();
+
+// write changed slots to eeprom, blocks for every byte, journal must not be writing
+void scenes_save();
@@ -0,0 +1,128 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <stdlib.h> 
+#include <stdbool.h> 
+
+#include "output.h"
+#include "storage.h"
+#include "counters.h"
+
+// every record: mask bytes (lsb first), checksum and sequence number, which is written last
+enum {
+    Record_Mask = 0,
+    Record_Checksum = OUTPUT_BYTES,
+    Record_Sequence = OUTPUT_BYTES+1,
+    RECORD_SIZE
+};
+
+static uint8_t journal[JOURNAL_RECORDS][RECORD_SIZE] EEMEM;
+
+// the newest record in the journal (or the one being written now)
+static uint8_t lastIndex = JOURNAL_RECORDS-1;
+static uint8_t lastSequence = 0xFF;
+static OutputMask lastMask = 0x00;
+static bool hasRecords = false;
+
+// record which is being written byte by byte
+static volatile uint8_t writeBuffer[RECORD_SIZE];
+static volatile uint8_t writePosition = RECORD_SIZE;
+static volatile bool hasPendingMask = false;
+static volatile OutputMask pendingMask = 0x00;
+
+// both erased (0xFF) and zeroed records are invalid
+static inline uint8_t storage_checksum(OutputMask mask, uint8_t sequence) {
+    uint8_t checksum = sequence ^ 0x5A;
+    for ( uint8_t i=0; i<OUTPUT_BYTES; i++ ) {
+        checksum ^= OUTPUT_BYTE(mask, i);
+    }
+    return checksum;
+}
+
+/* ------------- interrupt-driven writes ------------ */
+
+// next slot in a ring, interrupt is enabled until the whole record is written
+static void storage_startRecord(OutputMask mask) {
+    lastIndex = (lastIndex+1) % JOURNAL_RECORDS;
+    lastSequence++;
+    lastMask = mask;
+    hasRecords = true;
+
+    for ( uint8_t i=0; i<OUTPUT_BYTES; i++ ) {
+        writeBuffer[Record_Mask+i] = OUTPUT_BYTE(mask, i);
+    }
+    writeBuffer[Record_Checksum] = storage_checksum(mask, lastSequence);
+    writeBuffer[Record_Sequence] = lastSequence;
+    writePosition = 0;
+
+    EECR |= _BV(EERIE);
+}
+
+// eeprom is ready for the next byte
+ISR(EE_READY_vect) {
+    counters_increment(Counter_EE_READY);
+
+    if ( writePosition < RECORD_SIZE ) {
+        //the write is only started here, eeprom will call us again when it's done
+        eeprom_write_byte(&journal[lastIndex][writePosition], writeBuffer[writePosition]);
+        counters_increment(Counter_EepromWrites);
+        writePosition++;
+    } else if ( hasPendingMask ) {
+        hasPendingMask = false;
+        storage_startRecord(pendingMask); //mask has been changed while we were busy
+    } else {
+        EECR &= ~_BV(EERIE); //all done
+    }
+}
+
+/* -------------------------------------------------- */
+
+// find the record with the greatest sequence number, it takes a few hundred eeprom reads
+void init_storage() {
+    hasRecords = false;
+
+    for ( uint8_t i=0; i<JOURNAL_RECORDS; i++ ) {
+        uint8_t record[RECORD_SIZE];
+        eeprom_read_block(record, journal[i], RECORD_SIZE);
+
+        OutputMask mask = 0x00;
+        for ( uint8_t b=0; b<OUTPUT_BYTES; b++ ) {
+            mask |= (OutputMask)record[Record_Mask+b] << (b*8);
+        }
+
+        if ( record[Record_Checksum] != storage_checksum(mask, record[Record_Sequence]) ) {
+            continue; //never written or interrupted by power loss
+        }
+
+        //sequence numbers wrap around, but all records are within JOURNAL_RECORDS of each other
+        if ( !hasRecords || (int8_t)(record[Record_Sequence] - lastSequence) > 0 ) {
+            lastIndex = i;
+            lastSequence = record[Record_Sequence];
+            lastMask = mask;
+            hasRecords = true;
+        }
+    }
+}
+
+bool storage_restoreMask(OutputMask *mask) {
+    if ( hasRecords ) {
+        *mask = lastMask;
+    }
+    return hasRecords;
+}
+
+void storage_saveMask(OutputMask mask) {
+    uint8_t sreg = SREG;
+    cli();
+    if ( storage_busy() ) {
+        hasPendingMask = (mask != lastMask); //the last queued state wins
+        pendingMask = mask;
+    } else if ( !hasRecords || mask != lastMask ) {
+        storage_startRecord(mask);
+    }
+    SREG = sreg;
+}
+
+bool storage_busy() {
+    return (EECR & _BV(EERIE)) != 0;
+}
@@ -0,0 +1,24 @@
+/* ------------------------------------- 
+	<storage.h>
+	• journal of output states in EEPROM
+	• records rotate over the journal to spread the wear
+	• writes are done from EE_READY interrupt, main loop never waits
+------------------------------------- */
+
+#define JOURNAL_RECORD_SIZE  (OUTPUT_BYTES+2) //mask, checksum and sequence number
+#define JOURNAL_RECORDS  (192/JOURNAL_RECORD_SIZE) //64 records for a single 595
+
+/* INTERRUPTS */
+ISR(EE_READY_vect);
+
+/* FUNCTIONS */
+void init_storage(); //find the newest record
+
+// the newest saved mask, returns false if journal is empty
+bool storage_restoreMask(OutputMask *mask);
+
+// append a new record, unless the mask is the same as the last one
+void storage_saveMask(OutputMask mask);
+
+// is there a record still being written
+bool storage_busy();
@@ -0,0 +1,40 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdlib.h> 
+#include <stdbool.h> 
+
+#include "systick.h"
+#include "counters.h"
+
+static volatile uint16_t ticks = 0x0000;
+
+// timer 2 compare event
+ISR(TIMER2_COMPA_vect) {
+    counters_increment(Counter_TIMER2_COMPA);
+    ticks++;
+
+    if ( systick_each_tick ) { //it's a weak function
+        systick_each_tick();
+    }
+}
+
+// basic setup, timer2 in CTC mode
+void init_systick() {
+    TCCR2A = _BV(WGM21); //CTC mode
+    TCCR2B = _BV(CS20) | _BV(CS21) | _BV(CS22); //1024 prescaler
+
+    OCR2A = F_CPU/1024/SYSTICK_HZ - 1;
+
+    TIMSK2 = _BV(OCIE2A); //compare interrupt enabled
+    TIFR2 &= ~_BV(OCF2A); //reset flag
+}
+
+// 16-bit value is updated from the interrupt, read it atomically
+uint16_t systick_now() {
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t now = ticks;
+    SREG = sreg;
+
+    return now;
+}
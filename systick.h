@@ -0,0 +1,19 @@
+/* ------------------------------------- 
+	<systick.h>
+	• periodic system tick on timer2
+	• timestamps for events
+------------------------------------- */
+
+#define SYSTICK_HZ  100 //10ms per tick
+
+/* INTERRUPTS */
+ISR(TIMER2_COMPA_vect);
+
+/* FUNCTIONS */
+void init_systick(); //basic setup
+
+// number of ticks since power up, wraps around
+uint16_t systick_now();
+
+// OVERRIDE: called from timer interrupt on every tick
+void systick_each_tick() __attribute__((weak));
@@ -16,12 +16,20 @@ void blink() {
 }
 
 void strobeAddress(uint8_t address) {
-   for ( int i=0; i<address*2; i++ ) {
-     digitalWrite(2, HIGH);      
-     delay(1);
-     digitalWrite(2, LOW); 
-     delay(1);
-   }   
+   //chain position and inverted crc-4, bits are told apart by time between falling edges
+   uint8_t crc = 0;
+   for ( int i=0; i<8; i++ ) {
+     bool feedback = ((crc >> 3) ^ (address >> i)) & 0x01;
+     crc = (crc << 1) & 0x0F;
+     if ( feedback ) crc ^= 0x03;
+   }
+   uint16_t frame = address | ((uint16_t)(crc ^ 0x0F) << 8);
+
+   for ( int i=0; i<=12; i++ ) {
+     digitalWrite(2, HIGH);  delayMicroseconds(64);
+     digitalWrite(2, LOW);
+     if ( i < 12 ) delayMicroseconds(((frame >> i) & 0x01) ? 256 : 64);
+   }
 }
 
 void executeReadCommand(uint8_t address) {
@@ -29,11 +37,7 @@ void executeReadCommand(uint8_t address) {
      Wire.beginTransmission(address);  {
       uint8_t cmd[2] = { 'G', 0x00 }; //get all command 
       Wire.write(cmd, 2); 
-   }; Wire.endTransmission();  
-   
-   
-   //wait before new start condition   
-   delay(5); 
+   }; Wire.endTransmission(false); //read command is answered right away, use repeated start
    
    //request read command
    Wire.requestFrom((int)address, 1, true);
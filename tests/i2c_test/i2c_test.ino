@@ -23,14 +23,41 @@ typedef struct {
 } Command;
 
 void strobeAddress(uint8_t address) {
-   for ( int i=0; i<address*2; i++ ) {
-     digitalWrite(2, HIGH);  delay(1);
-     digitalWrite(2, LOW);   delay(1);
-   }   
+   //chain position and inverted crc-4, bits are told apart by time between falling edges
+   uint8_t crc = 0;
+   for ( int i=0; i<8; i++ ) {
+     bool feedback = ((crc >> 3) ^ (address >> i)) & 0x01;
+     crc = (crc << 1) & 0x0F;
+     if ( feedback ) crc ^= 0x03;
+   }
+   uint16_t frame = address | ((uint16_t)(crc ^ 0x0F) << 8);
+
+   for ( int i=0; i<=12; i++ ) {
+     digitalWrite(2, HIGH);  delayMicroseconds(64);
+     digitalWrite(2, LOW);
+     if ( i < 12 ) delayMicroseconds(((frame >> i) & 0x01) ? 256 : 64);
+   }
+}
+
+//several commands in one transaction
+void sendBurst(Command *commands, uint8_t count) {
+   Wire.beginTransmission(I2C_ADDRESS);  {
+      Wire.write((uint8_t *)commands, count*2);
+   }; Wire.endTransmission();
 }
 
 void loop() {
   
+   Command scene[4] = { { 's', 0b11110001 }, //turn on first
+                        { 's', 0b00000010 }, //turn off second
+                        { 's', 0b11110011 }, //turn on third
+                        { 't', 0b00000100 }, //toggle fourth
+   };
+
+   blink();
+   sendBurst(scene, 4);
+   delay(4000);
+
    Command commands[14] = { { 'S', 0b01010101 }, //toggle
                             { 'S', 0b10101010 }, //pattern
                       
@@ -63,7 +90,6 @@ void loop() {
        }; byte c = Wire.endTransmission();  
        
        if ( cmd.cmd == 'G' || cmd.cmd == 'g' ) {
-         delay(5); //wait before new start condition
          Wire.requestFrom(I2C_ADDRESS, 1);
          byte c = Wire.read();    // receive a byte as character
          
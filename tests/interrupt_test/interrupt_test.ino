@@ -27,15 +27,75 @@ void loop() {
    //interrupt line held down
    if ( digitalRead(8) == 0 ) {
          blink();
+         readRegisters();
+         readEvents();
          executeReadCommand();
    }
 }
 
 void strobeAddress(uint8_t address) {
-   for ( int i=0; i<address*2; i++ ) {
-     digitalWrite(2, HIGH);  delay(1);
-     digitalWrite(2, LOW);   delay(1);
-   }   
+   //chain position and inverted crc-4, bits are told apart by time between falling edges
+   uint8_t crc = 0;
+   for ( int i=0; i<8; i++ ) {
+     bool feedback = ((crc >> 3) ^ (address >> i)) & 0x01;
+     crc = (crc << 1) & 0x0F;
+     if ( feedback ) crc ^= 0x03;
+   }
+   uint16_t frame = address | ((uint16_t)(crc ^ 0x0F) << 8);
+
+   for ( int i=0; i<=12; i++ ) {
+     digitalWrite(2, HIGH);  delayMicroseconds(64);
+     digitalWrite(2, LOW);
+     if ( i < 12 ) delayMicroseconds(((frame >> i) & 0x01) ? 256 : 64);
+   }
+}
+
+void readRegisters() {
+   Command selectRegister = { 'r', 0x00 }; //start from the first register
+
+   //write register pointer, then read with repeated start
+   Wire.beginTransmission(I2C_ADDRESS);  {
+      Wire.write((uint8_t *)&selectRegister, 2);
+   }; Wire.endTransmission(false);
+
+   Wire.requestFrom(I2C_ADDRESS, 5);
+
+   Serial.print("state=");
+   Serial.print(Wire.read(), BIN);
+   Serial.print(", inputs=");
+   Serial.print(Wire.read(), BIN);
+   Serial.print(", presses=");
+   Serial.print(Wire.read(), DEC);
+   Serial.print(", commands=");
+   Serial.println(Wire.read() | (Wire.read()<<8), DEC);
+}
+
+void readEvents() {
+   Command getEvents = { 'e', 0x00 }; //drain switch events
+
+   Wire.beginTransmission(I2C_ADDRESS);  {
+      Wire.write((uint8_t *)&getEvents, 2);
+   }; Wire.endTransmission(false);
+
+   Wire.requestFrom(I2C_ADDRESS, 1+3*8); //header and up to 8 events
+
+   byte header = Wire.read();
+   if ( header & 0x80 ) {
+      Serial.println("some events were lost");
+   }
+
+   for ( int i=0; i<(header & 0x7F) && i<8; i++ ) {
+      byte info = Wire.read();
+      unsigned int time = Wire.read() | (Wire.read()<<8);
+
+      Serial.print("pin=");
+      Serial.print(info & 0x07, DEC);
+      Serial.print((info & 0x08) ? " pressed" : " released");
+      Serial.print(", type=");
+      Serial.print((info >> 4) & 0x03, DEC);
+      Serial.print(", time=");
+      Serial.println(time, DEC);
+   }
 }
 
 void executeReadCommand() {
@@ -44,11 +104,7 @@ void executeReadCommand() {
    //transmit command
      Wire.beginTransmission(I2C_ADDRESS);  {
       Wire.write((uint8_t *)&getAllCommand, 2); 
-   }; Wire.endTransmission();  
-   
-   
-   //wait before new start condition   
-   delay(5); 
+   }; Wire.endTransmission(false); //read command is answered right away, use repeated start
    
    //request read command
    Wire.requestFrom(I2C_ADDRESS, 1);
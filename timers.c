@@ -0,0 +1,165 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <stdlib.h> 
+#include <stdbool.h> 
+
+#include "output.h"
+#include "timers.h"
+#include "systick.h"
+#include "counters.h"
+
+#define TICKS_PER_STEP  (TIMERS_TICK_MS/(1000/SYSTICK_HZ))
+
+static uint8_t autoOffEeprom[OUTPUT_COUNT] EEMEM;
+
+static uint8_t autoOffLengths[OUTPUT_COUNT];
+static OutputMask autoOffOutputs = 0x00; //channels with auto-off, to find them quickly
+static bool autoOffDirty = false;
+
+// countdowns in steps, written from the main loop and the tick interrupt
+static volatile uint16_t remaining[OUTPUT_COUNT];
+static volatile OutputMask countingOutputs = 0x00;
+static OutputMask lastOutputs = 0x00; //to see which outputs were switched on since the last step
+static uint8_t stepTicks = 0;
+
+static const uint16_t unitSteps[] = { 1, 10, 100, 600 };
+
+static uint16_t timers_steps(uint8_t length) {
+    return (length & 0x3F) * unitSteps[length >> 6];
+}
+
+void init_timers() {
+    for ( uint8_t i=0; i<OUTPUT_COUNT; i++ ) {
+        uint8_t length = eeprom_read_byte(&autoOffEeprom[i]);
+        autoOffLengths[i] = (length == 0xFF) ? 0x00 : length; //erased eeprom means no auto-off
+        if ( autoOffLengths[i] != 0x00 ) {
+            autoOffOutputs |= OUTPUT_BIT(i);
+        }
+    }
+    autoOffDirty = false;
+}
+
+void timers_start(OutputMask outputs, uint8_t length) {
+    uint16_t steps = timers_steps(length);
+
+    uint8_t sreg = SREG;
+    cli();
+    for ( uint8_t i=0; i<OUTPUT_COUNT; i++ ) {
+        if ( outputs & OUTPUT_BIT(i) ) {
+            remaining[i] = steps;
+        }
+    }
+
+    if ( steps != 0 ) {
+        countingOutputs |= outputs;
+    } else {
+        countingOutputs &= ~outputs;
+    }
+    lastOutputs |= outputs; //already on, auto-off must not replace the pulse
+    SREG = sreg;
+}
+
+// called from the tick interrupt, outputs are checked every step
+bool timers_validPulse(uint8_t length) {
+    return timers_steps(length) != 0;
+}
+
+void timers_tick() {
+    if ( ++stepTicks < TICKS_PER_STEP ) {
+        return;
+    }
+    stepTicks = 0;
+
+    OutputMask outputs = currentOutputStateMask();
+    OutputMask switchedOn = outputs & ~lastOutputs & autoOffOutputs & ~countingOutputs;
+    lastOutputs = outputs;
+
+    countingOutputs &= outputs; //switched off by somebody else, countdown is not needed anymore
+    if ( (countingOutputs | switchedOn) == 0x00 ) {
+        return; //nothing to count, the usual case
+    }
+
+    OutputMask expired = 0x00;
+    for ( uint8_t i=0; i<OUTPUT_COUNT; i++ ) {
+        OutputMask bit = OUTPUT_BIT(i);
+
+        if ( switchedOn & bit ) {
+            remaining[i] = timers_steps(autoOffLengths[i]);
+            countingOutputs |= bit;
+        } else if ( (countingOutputs & bit) && --remaining[i] == 0 ) {
+            expired |= bit;
+        }
+    }
+
+    if ( expired != 0x00 ) {
+        countingOutputs &= ~expired;
+        lastOutputs &= ~expired;
+        clearOutputStateBits(expired);
+    }
+}
+
+void timers_setAutoOff(uint8_t channel, uint8_t length) {
+    if ( channel >= OUTPUT_COUNT || autoOffLengths[channel] == length ) {
+        return;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    autoOffLengths[channel] = length;
+    if ( length != 0x00 ) {
+        autoOffOutputs |= OUTPUT_BIT(channel);
+    } else {
+        autoOffOutputs &= ~OUTPUT_BIT(channel);
+    }
+    SREG = sreg;
+
+    autoOffDirty = true;
+}
+
+uint8_t timers_autoOff(uint8_t channel) {
+    return (channel < OUTPUT_COUNT) ? autoOffLengths[channel] : 0x00;
+}
+
+uint16_t timers_remaining(uint8_t channel) {
+    if ( channel >= OUTPUT_COUNT ) {
+        return 0;
+    }
+
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t steps = (countingOutputs & OUTPUT_BIT(channel)) ? remaining[channel] : 0;
+    SREG = sreg;
+
+    return steps;
+}
+
+bool timers_active() {
+    uint8_t sreg = SREG;
+    cli();
+    OutputMask outputs = currentOutputStateMask();
+    bool active = (countingOutputs != 0x00) || (outputs & ~lastOutputs & autoOffOutputs) != 0x00;
+    SREG = sreg;
+
+    return active;
+}
+
+bool timers_needSaving() {
+    return autoOffDirty;
+}
+
+void timers_save() {
+    autoOffDirty = false;
+
+    for ( uint8_t i=0; i<OUTPUT_COUNT; i++ ) {
+        if ( eeprom_read_byte(&autoOffEeprom[i]) == autoOffLengths[i] ) {
+            continue; //eeprom wears out on writes only
+        }
+        eeprom_write_byte(&autoOffEeprom[i], autoOffLengths[i]);
+
+        uint8_t sreg = SREG;
+        cli();
+        counters_increment(Counter_EepromWrites);
+        SREG = sreg;
+    }
+}
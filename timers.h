@@ -0,0 +1,44 @@
+/* ------------------------------------- 
+	<timers.h>
+	• countdown for every output, the output goes off when it's over
+	• pulses: on now, off after a given time
+	• auto-off: channel goes off by itself some time after it was switched on
+	• auto-off lengths are stored in EEPROM
+------------------------------------- */
+
+#define TIMERS_TICK_MS      100 //countdown resolution
+
+// lengths fit one byte: 6 lsb — value, 2 msb — unit (100ms, 1s, 10s, 1min), up to 63 minutes
+#define TIMER_LENGTH(unit, value)   (((unit) << 6) | ((value) & 0x3F))
+enum TimerUnits {
+    Timer_Tenths = 0x00,
+    Timer_Seconds,
+    Timer_TenSeconds,
+    Timer_Minutes,
+};
+
+/* FUNCTIONS */
+void init_timers(); //auto-off lengths from eeprom
+void timers_tick(); //call on every system tick
+
+// start countdowns for all given outputs, they have to be switched on already
+void timers_start(OutputMask outputs, uint8_t length);
+
+// a pulse needs at least one step, a zero length would leave the output on for good
+bool timers_validPulse(uint8_t length);
+
+// auto-off length for a channel (zero based), zero length turns auto-off off
+void timers_setAutoOff(uint8_t channel, uint8_t length);
+uint8_t timers_autoOff(uint8_t channel);
+
+// time left for a channel in TIMERS_TICK_MS, zero if it's not counting
+uint16_t timers_remaining(uint8_t channel);
+
+// is any countdown running or about to start, system tick has to keep going
+bool timers_active();
+
+// are there auto-off lengths not written to eeprom yet
+bool timers_needSaving();
+
+// write changed auto-off lengths to eeprom, blocks for every byte, journal must not be writing
+void timers_save();